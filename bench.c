@@ -0,0 +1,262 @@
+/*
+ * bench.c - Time functions in child processes, several at once
+ *
+ * Each function given to bench_add is timed in a child process of its
+ * own, forked when it is added, so that its runs start from the state of
+ * the caller at that moment and share no heap, allocator state or cache
+ * below the last level with the runs of any other function.  Until
+ * bench_run releases it, a child waits on a pipe, so that it does not
+ * compete with its parent.  bench_run releases one child on each CPU that
+ * the process may run on, and releases the next child on a CPU whenever
+ * that CPU's child finishes, so independent functions are timed at once
+ * on separate CPUs.  Use taskset to restrict the CPUs used.
+ *
+ * A child pins itself to its CPU and runs its function BENCH_WARMUP times
+ * untimed, which also faults in what it shares copy-on-write with its
+ * parent.  Then it runs the function reps more times, timing each run
+ * with the monotonic clock and the cycle counter.  It writes each run's
+ * times down a pipe, and the parent summarizes them once the child has
+ * exited.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "clock.h"
+
+/* A child waiting to be run, running, or finished */
+typedef struct {
+    pid_t pid;         /* process timing the function */
+    int gate;          /* write end of the pipe that releases the child */
+    int times;         /* read end of the pipe that the child reports on */
+    bench_t *result;   /* where to summarize the child's runs */
+} child_t;
+
+static child_t *children = NULL;  /* children in the order added */
+static int nchildren = 0;         /* number of children added */
+static int maxchildren = 0;       /* number of children that fit */
+static int reps = BENCH_REPS;     /* timed runs of each function */
+
+static void bench_child(bench_funct f, void *argp, int gate, int times);
+static void bench_release(child_t *child, int cpu);
+static void bench_summarize(child_t *child);
+static double t_quantile(int df);
+static void bench_unix_error(char *msg);
+static void bench_app_error(char *msg);
+
+/*
+ * set_bench_reps - Set the number of timed runs of each function
+ */
+void set_bench_reps(int reps_arg)
+{
+    if (reps_arg < 2)
+	reps_arg = 2;
+    reps = (reps_arg < BENCH_MAX_REPS) ? reps_arg : BENCH_MAX_REPS;
+}
+
+/*
+ * bench_add - Fork a child to time f(argp), and leave it waiting
+ */
+void bench_add(bench_funct f, void *argp, bench_t *result)
+{
+    int gate[2], times[2], i;
+    pid_t pid;
+
+    if (nchildren == maxchildren) {
+	maxchildren = (maxchildren > 0) ? 2 * maxchildren : 16;
+	children = realloc(children, maxchildren * sizeof(child_t));
+	if (children == NULL)
+	    bench_unix_error("children realloc in bench_add failed");
+    }
+    if (pipe(gate) < 0 || pipe(times) < 0)
+	bench_unix_error("pipe in bench_add failed");
+
+    /* Leave nothing buffered for the child to print again */
+    fflush(NULL);
+    if ((pid = fork()) < 0)
+	bench_unix_error("fork in bench_add failed");
+    if (pid == 0) {
+	/* Hold no pipe of another child, so each sees its parent exit */
+	for (i = 0; i < nchildren; i++) {
+	    close(children[i].gate);
+	    close(children[i].times);
+	}
+	close(gate[1]);
+	close(times[0]);
+	bench_child(f, argp, gate[0], times[1]);
+    }
+    close(gate[0]);
+    close(times[1]);
+    children[nchildren].pid = pid;
+    children[nchildren].gate = gate[1];
+    children[nchildren].times = times[0];
+    children[nchildren].result = result;
+    nchildren++;
+}
+
+/*
+ * bench_run - Release the children on the CPUs that the process may run
+ *     on, one at a time on each CPU, and summarize their runs
+ */
+void bench_run(void)
+{
+    cpu_set_t set;
+    int cpus[CPU_SETSIZE], ncpus = 0;
+    int next = 0, running = 0, status, cpu, i;
+    pid_t pid;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+	bench_unix_error("sched_getaffinity in bench_run failed");
+    for (cpu = CPU_SETSIZE - 1; cpu >= 0; cpu--)
+	if (CPU_ISSET(cpu, &set))
+	    cpus[ncpus++] = cpu;
+
+    while (next < nchildren || running > 0) {
+	/* Release the next child on a free CPU, lowest numbered first */
+	if (next < nchildren && ncpus > 0) {
+	    bench_release(&children[next++], cpus[--ncpus]);
+	    running++;
+	    continue;
+	}
+
+	/* Otherwise wait for a child to finish, and free its CPU */
+	if ((pid = waitpid(-1, &status, 0)) < 0)
+	    bench_unix_error("waitpid in bench_run failed");
+	for (i = 0; i < next && children[i].pid != pid; i++)
+	    ;
+	if (i == next)
+	    continue;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	    bench_app_error("A benchmark child failed");
+	bench_summarize(&children[i]);
+	cpus[ncpus++] = children[i].result->cpu;
+	running--;
+    }
+
+    free(children);
+    children = NULL;
+    nchildren = maxchildren = 0;
+}
+
+/*
+ * bench_child - Wait to be released onto a CPU, then time the runs of
+ *     f(argp) there, and exit
+ */
+static void bench_child(bench_funct f, void *argp, int gate, int times)
+{
+    cpu_set_t set;
+    struct timespec start, end;
+    double run[2];  /* seconds and cycles of one run */
+    int cpu, i;
+
+    /* The pipe reads as closed if the parent exits before releasing us */
+    if (read(gate, &cpu, sizeof(cpu)) != sizeof(cpu))
+	_exit(1);
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+	_exit(1);
+
+    for (i = 0; i < BENCH_WARMUP; i++)
+	f(argp);
+    for (i = 0; i < reps; i++) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	start_counter();
+	f(argp);
+	run[1] = get_counter();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	run[0] = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (write(times, run, sizeof(run)) != sizeof(run))
+	    _exit(1);
+    }
+    _exit(0);
+}
+
+/*
+ * bench_release - Start child on cpu
+ */
+static void bench_release(child_t *child, int cpu)
+{
+    child->result->cpu = cpu;
+    if (write(child->gate, &cpu, sizeof(cpu)) != sizeof(cpu))
+	bench_unix_error("write in bench_release failed");
+    close(child->gate);
+}
+
+/*
+ * bench_summarize - Read the times of the runs of a child that has
+ *     exited, and summarize them in its result.  The times fit in the
+ *     pipe, so the child never waits for them to be read.
+ */
+static void bench_summarize(child_t *child)
+{
+    bench_t *b = child->result;
+    double run[2], sum = 0, sumsq = 0, cycles = 0;
+    int i;
+
+    for (i = 0; i < reps; i++) {
+	if (read(child->times, run, sizeof(run)) != sizeof(run))
+	    bench_app_error("A benchmark child reported too few runs");
+	b->secs[i] = run[0];
+	sum += run[0];
+	cycles += run[1];
+    }
+    close(child->times);
+
+    b->n = reps;
+    b->mean = sum / reps;
+    b->min = b->max = b->secs[0];
+    for (i = 0; i < reps; i++) {
+	sumsq += (b->secs[i] - b->mean) * (b->secs[i] - b->mean);
+	b->min = (b->secs[i] < b->min) ? b->secs[i] : b->min;
+	b->max = (b->secs[i] > b->max) ? b->secs[i] : b->max;
+    }
+    b->stddev = sqrt(sumsq / (reps - 1));
+    b->ci = t_quantile(reps - 1) * b->stddev / sqrt(reps);
+    b->cycles = cycles / reps;
+}
+
+/*
+ * t_quantile - Return the 97.5th percentile of Student's t distribution
+ *     with df degrees of freedom, which bounds a 95% confidence interval.
+ *     Beyond the table, 1.96 + 2.4/df is within 0.002 of it.
+ */
+static double t_quantile(int df)
+{
+    static const double t975[] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+
+    if (df <= (int)(sizeof(t975) / sizeof(t975[0])))
+	return t975[df - 1];
+    return 1.96 + 2.4 / df;
+}
+
+/*
+ * bench_unix_error - Report a Unix-style error and exit
+ */
+static void bench_unix_error(char *msg)
+{
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+/*
+ * bench_app_error - Report an arbitrary error and exit
+ */
+static void bench_app_error(char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
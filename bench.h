@@ -0,0 +1,45 @@
+/*
+ * bench.h - Prototypes for the routines in bench.c, which time a
+ *     function in a pinned child process of its own, running the children
+ *     of several functions at once, one per CPU
+ */
+#ifndef __BENCH_H_
+#define __BENCH_H_
+
+#define BENCH_WARMUP      2   /* untimed runs before the timed ones */
+#define BENCH_REPS       20   /* default number of timed runs */
+#define BENCH_MAX_REPS 1000   /* most timed runs */
+
+/* The function to time takes a generic pointer as input */
+typedef void (*bench_funct)(void *);
+
+/* Summarizes the timed runs of one function */
+typedef struct {
+    int n;            /* number of timed runs */
+    int cpu;          /* CPU that the runs were pinned to */
+    double mean;      /* mean seconds per run */
+    double stddev;    /* sample standard deviation of the seconds */
+    double ci;        /* half-width of the 95% confidence interval of mean */
+    double min, max;  /* seconds of the fastest and slowest runs */
+    double cycles;    /* mean cycles per run, by the cycle counter */
+    double secs[BENCH_MAX_REPS]; /* seconds of each run */
+} bench_t;
+
+/*
+ * set_bench_reps - Set the number of timed runs of each function, from 2
+ *     to BENCH_MAX_REPS
+ *     Default = BENCH_REPS
+ */
+void set_bench_reps(int reps);
+
+/*
+ * bench_add - Fork the child that will time f(argp), which sees the
+ *     caller's memory as it is now, and summarize its runs in result once
+ *     bench_run has run it
+ */
+void bench_add(bench_funct f, void *argp, bench_t *result);
+
+/* bench_run - Run the children of every function added, and wait for them */
+void bench_run(void);
+
+#endif /* __BENCH_H_ */
@@ -0,0 +1,380 @@
+/*
+ * cap2rep.c - Convert a capture made by mmcapture into a trace
+ *
+ * The records of the capture are sorted into the order in which the
+ * requests were made and replayed against a map from the address of
+ * each live block to its id.  Ids are handed out densely, and the id of
+ * a freed block is reused by the next allocation, so that num_ids is the
+ * most blocks live at once rather than the number of requests.  Requests
+ * on blocks that were allocated while nothing was captured are dropped,
+ * as are the blocks too large for a trace.  By default the trace is
+ * written as a text .rep trace; with -b, as a binary trace (trace.h).
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+#define MAP_MINBITS 10          /* log2 of the smallest map */
+#define NO_ID       UINT32_MAX  /* id of a block left out of the trace */
+
+/* An open-addressed hash map from nonzero keys to ids */
+typedef struct {
+    uint64_t *keys;   /* 0 in an empty slot */
+    uint32_t *ids;
+    int bits;         /* log2 of the number of slots */
+    size_t count;     /* number of keys in the map */
+} map_t;
+
+/* The trace being built */
+typedef struct {
+    traceop_t *ops;
+    size_t num_ops;
+    uint32_t num_ids;
+    uint32_t *free_ids;   /* stack of ids free for reuse */
+    size_t num_free;
+} trace_t;
+
+static int cmp_seq(const void *a, const void *b);
+static void convert(caprec_t *recs, size_t n, trace_t *trace);
+static void new_block(trace_t *trace, map_t *live, uint64_t ptr,
+		      uint64_t size);
+static void drop_stale(trace_t *trace, map_t *live, uint64_t ptr);
+static void add_op(trace_t *trace, int type, uint32_t id, uint64_t size);
+static void free_id(trace_t *trace, uint32_t id);
+static void map_init(map_t *map, int bits);
+static size_t map_slot(map_t *map, uint64_t key);
+static void map_put(map_t *map, uint64_t key, uint32_t id);
+static int map_take(map_t *map, uint64_t key, uint32_t *id);
+static void *xmalloc(size_t size);
+static void usage(void);
+static void unix_error(char *msg, char *path);
+static void app_error(char *msg, char *path);
+
+int main(int argc, char **argv)
+{
+    int fd, binary = 0;
+    char *inpath, *outpath;
+    struct stat st;
+    caprec_t *recs;
+    size_t n, i;
+    trace_t trace;
+    tracehdr_t hdr;
+    FILE *out;
+
+    if (argc == 4 && strcmp(argv[1], "-b") == 0) {
+	binary = 1;
+	argv++;
+    } else if (argc != 3) {
+	usage();
+	exit(1);
+    }
+    inpath = argv[1];
+    outpath = argv[2];
+
+    /* Map the capture privately, so that it can be sorted in place */
+    if ((fd = open(inpath, O_RDONLY)) < 0)
+	unix_error("Could not open", inpath);
+    if (fstat(fd, &st) < 0)
+	unix_error("Could not stat", inpath);
+    if (st.st_size % sizeof(caprec_t) != 0)
+	app_error("Truncated capture", inpath);
+    if ((n = st.st_size / sizeof(caprec_t)) == 0)
+	app_error("No requests in", inpath);
+    recs = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		fd, 0);
+    if (recs == MAP_FAILED)
+	unix_error("Could not map", inpath);
+    close(fd);
+
+    qsort(recs, n, sizeof(caprec_t), cmp_seq);
+    convert(recs, n, &trace);
+    if (trace.num_ops == 0)
+	app_error("No requests on captured blocks in", inpath);
+
+    if ((out = fopen(outpath, "w")) == NULL)
+	unix_error("Could not create", outpath);
+    if (binary) {
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	hdr.order = TRACE_ORDER;
+	hdr.num_ids = trace.num_ids;
+	hdr.num_ops = trace.num_ops;
+	hdr.weight = 1;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+	    fwrite(trace.ops, sizeof(traceop_t), trace.num_ops, out) !=
+	    trace.num_ops)
+	    unix_error("Could not write", outpath);
+    } else {
+	fprintf(out, "0\n%u\n%zu\n1\n", trace.num_ids, trace.num_ops);
+	for (i = 0; i < trace.num_ops; i++) {
+	    switch (trace.ops[i].type) {
+	    case ALLOC:
+		fprintf(out, "a %d %d\n", trace.ops[i].index,
+			trace.ops[i].size);
+		break;
+	    case REALLOC:
+		fprintf(out, "r %d %d\n", trace.ops[i].index,
+			trace.ops[i].size);
+		break;
+	    case FREE:
+		fprintf(out, "f %d\n", trace.ops[i].index);
+		break;
+	    }
+	}
+    }
+    if (fclose(out) != 0)
+	unix_error("Could not write", outpath);
+    exit(0);
+}
+
+/*
+ * cmp_seq - Order capture records by seq
+ */
+static int cmp_seq(const void *a, const void *b)
+{
+    uint64_t x = ((const caprec_t *)a)->seq;
+    uint64_t y = ((const caprec_t *)b)->seq;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * convert - Turn the n records at recs, sorted by seq, into a trace
+ */
+static void convert(caprec_t *recs, size_t n, trace_t *trace)
+{
+    map_t live;      /* id of each live block, by address */
+    map_t moving;    /* id of each block in realloc, by seq of its release */
+    uint32_t id;
+    size_t i;
+
+    /* A record makes at most two requests, one of them a stale free */
+    trace->ops = xmalloc(2 * n * sizeof(traceop_t));
+    trace->num_ops = 0;
+    trace->num_ids = 0;
+    trace->free_ids = xmalloc(n * sizeof(uint32_t));
+    trace->num_free = 0;
+    map_init(&live, MAP_MINBITS);
+    map_init(&moving, MAP_MINBITS);
+
+    for (i = 0; i < n; i++) {
+	switch (CAP_KIND(recs[i].seq)) {
+	case CAP_ALLOC:
+	    new_block(trace, &live, recs[i].ptr, recs[i].size);
+	    break;
+	case CAP_FREE:
+	    if (map_take(&live, recs[i].ptr, &id) && id != NO_ID) {
+		add_op(trace, FREE, id, 0);
+		free_id(trace, id);
+	    }
+	    break;
+	case CAP_RELEASE:
+	    if (map_take(&live, recs[i].ptr, &id))
+		map_put(&moving, recs[i].seq, id);
+	    break;
+	case CAP_REALLOC:
+	    if (!map_take(&moving, recs[i].link, &id) || id == NO_ID) {
+		/* The old block was not captured, so this one is new */
+		new_block(trace, &live, recs[i].ptr, recs[i].size);
+	    } else if (recs[i].size > INT32_MAX) {
+		add_op(trace, FREE, id, 0);
+		free_id(trace, id);
+		drop_stale(trace, &live, recs[i].ptr);
+		map_put(&live, recs[i].ptr, NO_ID);
+	    } else {
+		add_op(trace, REALLOC, id, recs[i].size);
+		drop_stale(trace, &live, recs[i].ptr);
+		map_put(&live, recs[i].ptr, id);
+	    }
+	    break;
+	}
+    }
+}
+
+/*
+ * new_block - Give an id to a block allocated at ptr
+ */
+static void new_block(trace_t *trace, map_t *live, uint64_t ptr,
+		      uint64_t size)
+{
+    uint32_t id;
+
+    drop_stale(trace, live, ptr);
+    if (size > INT32_MAX) {
+	id = NO_ID;
+    } else {
+	id = (trace->num_free > 0) ? trace->free_ids[--trace->num_free] :
+	    trace->num_ids++;
+	add_op(trace, ALLOC, id, size);
+    }
+    map_put(live, ptr, id);
+}
+
+/*
+ * drop_stale - Free any block that the map still holds at ptr, which is
+ *     being reused, because the free of that block was not captured
+ */
+static void drop_stale(trace_t *trace, map_t *live, uint64_t ptr)
+{
+    uint32_t id;
+
+    if (map_take(live, ptr, &id) && id != NO_ID) {
+	add_op(trace, FREE, id, 0);
+	free_id(trace, id);
+    }
+}
+
+/*
+ * add_op - Append a request to the trace.  mm_malloc(0) returns NULL,
+ *     which mdriver rejects, so empty blocks are given one byte.
+ */
+static void add_op(trace_t *trace, int type, uint32_t id, uint64_t size)
+{
+    traceop_t *op = &trace->ops[trace->num_ops++];
+
+    op->type = type;
+    op->index = id;
+    op->size = (type != FREE && size == 0) ? 1 : size;
+}
+
+/*
+ * free_id - Make the id of a freed block available for reuse
+ */
+static void free_id(trace_t *trace, uint32_t id)
+{
+    trace->free_ids[trace->num_free++] = id;
+}
+
+/*
+ * map_init - Make an empty map with 2^bits slots
+ */
+static void map_init(map_t *map, int bits)
+{
+    map->bits = bits;
+    map->count = 0;
+    map->keys = calloc((size_t)1 << bits, sizeof(uint64_t));
+    map->ids = xmalloc(((size_t)1 << bits) * sizeof(uint32_t));
+    if (map->keys == NULL)
+	unix_error("Could not allocate", "a map");
+}
+
+/*
+ * map_slot - Return the slot that holds key, or the empty slot where it
+ *     belongs
+ */
+static size_t map_slot(map_t *map, uint64_t key)
+{
+    size_t mask = ((size_t)1 << map->bits) - 1;
+    size_t i = (key * 0x9e3779b97f4a7c15ULL) >> (64 - map->bits);
+
+    while (map->keys[i] != 0 && map->keys[i] != key)
+	i = (i + 1) & mask;
+    return i;
+}
+
+/*
+ * map_put - Map key to id, doubling the map when it is half full
+ */
+static void map_put(map_t *map, uint64_t key, uint32_t id)
+{
+    map_t bigger;
+    size_t i, slot;
+
+    if (2 * (map->count + 1) > ((size_t)1 << map->bits)) {
+	map_init(&bigger, map->bits + 1);
+	for (i = 0; i < ((size_t)1 << map->bits); i++) {
+	    if (map->keys[i] != 0) {
+		slot = map_slot(&bigger, map->keys[i]);
+		bigger.keys[slot] = map->keys[i];
+		bigger.ids[slot] = map->ids[i];
+	    }
+	}
+	bigger.count = map->count;
+	free(map->keys);
+	free(map->ids);
+	*map = bigger;
+    }
+
+    slot = map_slot(map, key);
+    if (map->keys[slot] == 0)
+	map->count++;
+    map->keys[slot] = key;
+    map->ids[slot] = id;
+}
+
+/*
+ * map_take - Remove key from the map, returning whether it was there and
+ *     setting *id to what it mapped to.  The keys after it in its run of
+ *     full slots are shifted back, so that no slot is left as a tombstone.
+ */
+static int map_take(map_t *map, uint64_t key, uint32_t *id)
+{
+    size_t mask = ((size_t)1 << map->bits) - 1;
+    size_t i = map_slot(map, key);
+    size_t j, home;
+
+    if (map->keys[i] == 0)
+	return 0;
+    *id = map->ids[i];
+    map->count--;
+
+    for (j = (i + 1) & mask; map->keys[j] != 0; j = (j + 1) & mask) {
+	/* Move the key at j into the hole at i unless its home is in (i, j] */
+	home = (map->keys[j] * 0x9e3779b97f4a7c15ULL) >> (64 - map->bits);
+	if (((j - home) & mask) >= ((j - i) & mask)) {
+	    map->keys[i] = map->keys[j];
+	    map->ids[i] = map->ids[j];
+	    i = j;
+	}
+    }
+    map->keys[i] = 0;
+    return 1;
+}
+
+/*
+ * xmalloc - Allocate size bytes, or exit
+ */
+static void *xmalloc(size_t size)
+{
+    void *ptr;
+
+    if ((ptr = malloc(size)) == NULL)
+	unix_error("Could not allocate", "memory");
+    return ptr;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: cap2rep [-b] <capture> <trace>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b  Write a binary trace instead of a .rep trace.\n");
+}
+
+/*
+ * unix_error - Report a Unix-style error about the file at path
+ */
+static void unix_error(char *msg, char *path)
+{
+    fprintf(stderr, "%s %s: %s\n", msg, path, strerror(errno));
+    exit(1);
+}
+
+/*
+ * app_error - Report an error in the contents of the file at path
+ */
+static void app_error(char *msg, char *path)
+{
+    fprintf(stderr, "%s %s\n", msg, path);
+    exit(1);
+}
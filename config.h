@@ -62,6 +62,18 @@
  */
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
 
+/*
+ * Number of independent arenas simulated by memlib, each of which can
+ * grow to MEM_ARENA_SIZE bytes: MAX_HEAP by default, as mdriver's traces
+ * expect, and 4 GB (1UL << 32) in libmm.so, whose Makefile rule sets it
+ */
+#define MAX_ARENAS 8
+
+/* Size of each arena, which mdriver's traces expect to be MAX_HEAP */
+#ifndef MEM_ARENA_SIZE
+#define MEM_ARENA_SIZE MAX_HEAP
+#endif
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,12 +16,20 @@
 #include <string.h>
 #include <assert.h>
 #include <float.h>
+#include <math.h>
+#include <search.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "bench.h"
+#include "clock.h"
 #include "config.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -31,6 +40,26 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Threaded replay (-j) */
+#define JOB_REPS       5 /* replays per thread count; the fastest is kept */
+#define JOB_LEVELS    34 /* most thread counts, 1, 2, 4, ..., and the max */
+
+/* Deferred coalescing check */
+#define DEFER_BLOCKS 2000        /* blocks allocated, half freed remotely */
+#define DEFER_SIZE   600         /* bytes per block, small enough to bin */
+#define DEFER_FLUSH  (64 * 1024) /* request that takes back remote frees */
+
+/* 
+ * Latency histograms (-l).  Buckets are log-linear, as in an HDR
+ * histogram: each power of two of cycles is split into LAT_SUB buckets,
+ * so that a bucket's bounds are within 1/LAT_SUB of each other, and
+ * latencies below LAT_SUB cycles each get a bucket of their own.
+ */
+#define LAT_SUB_BITS   5 /* log2 of buckets per power of two */
+#define LAT_SUB        (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS  40 /* latencies are clamped below 2^40 cycles */
+#define LAT_BUCKETS    ((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB)
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
 
@@ -38,20 +67,15 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
-typedef struct range_t {
+/* 
+ * Records the extent of each block's payload.  The ranges of a trace's
+ * live blocks are kept in a tsearch(3) tree, ordered by address.
+ */
+typedef struct {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     unsigned sugg_heapsize;   /* suggested heap size (unused) */
@@ -61,6 +85,8 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    void *map;           /* mapping of a binary trace file, or NULL */
+    size_t mapsize;      /* size of that mapping */
 } trace_t;
 
 /* 
@@ -70,9 +96,27 @@ typedef struct {
  */
 typedef struct {
     trace_t *trace;  
-    range_t *ranges;
+    void *ranges;
 } speed_t;
 
+/* 
+ * Holds the params of one thread of a threaded replay.  Each thread
+ * replays the whole trace into its own array of blocks.
+ */
+typedef struct {
+    trace_t *trace;             /* the trace to replay */
+    char **blocks;              /* this thread's ptrs, indexed by trace id */
+    pthread_barrier_t *barrier; /* holds every thread until all are ready */
+    double start, end;          /* wall clock times of this thread's replay */
+} job_t;
+
+/* Holds a histogram of the latencies, in cycles, of one type of request */
+typedef struct {
+    unsigned long counts[LAT_BUCKETS]; /* number of latencies per bucket */
+    unsigned long n;                   /* number of latencies in all */
+    double max;                        /* largest latency */
+} hist_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -106,27 +150,59 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, 
+/* these functions manipulate range trees */
+static int range_cmp(const void *a, const void *b);
+static int add_range(void **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
-static void remove_range(range_t **ranges, char *lo);
-static void clear_ranges(range_t **ranges);
+static void remove_range(void **ranges, char *lo);
+static void clear_ranges(void **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static void map_trace(trace_t *trace, FILE *tracefile, char *path);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_valid(trace_t *trace, int tracenum, void **ranges);
+static void eval_mm_limits(void);
+static void eval_mm_defer(void);
+static size_t defer_inuse(int defer, char **blocks);
+static void *defer_thread(void *ptr);
+static double eval_mm_util(trace_t *trace, int tracenum, void **ranges);
 static void eval_mm_speed(void *ptr);
+static void replay_trace(trace_t *trace, char **blocks);
+
+/* Routines for replaying a trace on several threads at once (-j) */
+static int job_levels(int maxjobs, int *levels);
+static double eval_mm_jobs(trace_t *trace, int njobs, double *secs);
+static void *job_thread(void *ptr);
+static double wall_secs(void);
+
+/* Routines for measuring the latency of each request (-l) */
+static void eval_mm_latency(trace_t *trace, hist_t *hists);
+static void eval_mm_stats(trace_t *trace, int tracenum, int every);
+static void hist_add(hist_t *hist, double cycles);
+static void hist_merge(hist_t *into, hist_t *hist);
+static double hist_value(hist_t *hist, double fraction);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printlatency(char *title, hist_t *hists);
+static void printnodes(int tracenum);
+static void printsample(unsigned op, struct mm_stats *st, 
+			struct mm_stats *prev, size_t live, size_t requested);
+static void printclasses(struct mm_stats *st);
+static void printbench(int n, stats_t *stats, bench_t *bench);
+static void printjson(char *path, int n, char **tracefiles, stats_t *stats,
+		      bench_t *bench, double perfindex);
+static void printjsonstr(FILE *fp, char *str);
+static void printjobs(int njobs, double ops, double wall, double *secs,
+		      double base);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
+static void check_error(char *check, char *msg);
 static void app_error(char *msg);
 
 /**************
@@ -139,12 +215,26 @@ int main(int argc, char **argv)
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
-    stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
+    void *ranges = NULL;       /* keeps track of block extents for one trace */
+    stats_t *mm_results = NULL;  /* mm (i.e. student) stats per trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int numa = 0;        /* If set, bind arenas to NUMA nodes (-n) */
+    int check = 0;       /* If set, calls per heap check step (-c) */
+    int jobs = 0;        /* If set, most threads to replay traces on (-j) */
+    int latency = 0;     /* If set, print latency histograms (-l) */
+    int sample = 0;      /* If set, requests per heap stats sample (-s) */
+    int bench = 0;       /* If set, time traces in pinned children (-b) */
+    char *json = NULL;   /* If set, file to write the results to (-J) */
+    bench_t *bench_results = NULL; /* timed runs per trace (-b) */
+    hist_t *lat_trace = NULL, *lat_total = NULL; /* by type of request */
+
+    /* results of the threaded replays, by thread count (-j) */
+    int levels[JOB_LEVELS], nlevels = 0, l;
+    double job_ops[JOB_LEVELS], job_wall[JOB_LEVELS], job_base = 0, wall;
+    double *job_secs = NULL;
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -153,8 +243,17 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "gf:t:avVh")) != EOF) {
+    while ((c = getopt(argc, argv, "b:c:gf:j:J:s:t:alnvVh")) != EOF) {
         switch (c) {
+	case 'b': /* Time each trace this many times in a pinned child */
+	    if ((bench = atoi(optarg)) < 2 || bench > BENCH_MAX_REPS) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'c': /* Check part of the heap every so many calls */
+	    check = atoi(optarg);
+	    break;
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
 	    break;
@@ -166,6 +265,23 @@ int main(int argc, char **argv)
             tracefiles[0] = strdup(optarg);
             tracefiles[1] = NULL;
             break;
+	case 'j': /* Also replay each trace on up to this many threads */
+	    if ((jobs = atoi(optarg)) < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'J': /* Write the results to this file as JSON */
+	    json = optarg;
+	    if (bench == 0)
+		bench = BENCH_REPS;
+	    break;
+	case 's': /* Sample the heap's stats every so many requests */
+	    if ((sample = atoi(optarg)) < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
 	case 't': /* Directory where the traces are located */
 	    if (num_tracefiles == 1) /* ignore if -f already encountered */
 		break;
@@ -176,6 +292,12 @@ int main(int argc, char **argv)
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
+	case 'l': /* Time each request, and print latency histograms */
+	    latency = 1;
+	    break;
+	case 'n': /* Bind arenas to NUMA nodes and print where heaps reside */
+	    numa = 1;
+	    break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -228,7 +350,13 @@ int main(int argc, char **argv)
     }
 
     /* Initialize the timing package */
-    init_fsecs();
+    if (bench > 0) {
+	set_bench_reps(bench);
+	bench_results = (bench_t *)calloc(num_tracefiles, sizeof(bench_t));
+	if (bench_results == NULL)
+	    unix_error("bench_results calloc in main failed");
+    } else
+	init_fsecs();
 
     /*
      * Always run and evaluate the student's mm package
@@ -236,38 +364,123 @@ int main(int argc, char **argv)
     if (verbose > 1)
 	printf("\nTesting mm malloc\n");
 
-    /* Allocate the mm stats array, with one stats_t struct per tracefile */
-    mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
-    if (mm_stats == NULL)
-	unix_error("mm_stats calloc in main failed");
+    /* Allocate the mm results array, with one stats_t struct per tracefile */
+    mm_results = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+    if (mm_results == NULL)
+	unix_error("mm_results calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
+    if (numa && !mm_mallopt(MM_NUMA, 1))
+	app_error("mm_mallopt(MM_NUMA) failed");
+    if (check > 0 && !mm_mallopt(MM_CHECK_INTERVAL, check))
+	app_error("mm_mallopt(MM_CHECK_INTERVAL) failed");
+
+    /* Replaying on several threads needs the thread-safe allocator */
+    if (jobs > 0) {
+	if (!mm_thread_safe())
+	    app_error("-j needs the thread-safe allocator, as in mdriver-mt");
+	nlevels = job_levels(jobs, levels);
+	for (l = 0; l < nlevels; l++)
+	    job_ops[l] = job_wall[l] = 0;
+	if ((job_secs = (double *)calloc(jobs, sizeof(double))) == NULL)
+	    unix_error("job_secs calloc in main failed");
+    }
+
+    /* One histogram per type of request, for the trace and in total */
+    if (latency &&
+	((lat_trace = (hist_t *)calloc(REALLOC + 1, sizeof(hist_t))) == NULL ||
+	 (lat_total = (hist_t *)calloc(REALLOC + 1, sizeof(hist_t))) == NULL))
+	unix_error("latency calloc in main failed");
+
+    /* Requests too large for any heap must fail */
+    eval_mm_limits();
+
+    /* Deferred coalescing must not lose blocks that other threads free */
+    if (mm_thread_safe())
+	eval_mm_defer();
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
 	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
+	mm_results[i].ops = trace->num_ops;
 	if (verbose > 1)
 	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
+	mm_results[i].valid = eval_mm_valid(trace, i, &ranges);
+	if (mm_results[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_results[i].util = eval_mm_util(trace, i, &ranges);
+	    if (numa)
+		printnodes(i);
+	    if (sample > 0)
+		eval_mm_stats(trace, i, sample);
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (bench > 0)
+		bench_add(eval_mm_speed, &speed_params, &bench_results[i]);
+	    else
+		mm_results[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (latency) {
+		eval_mm_latency(trace, lat_trace);
+		sprintf(msg, "Trace %d", i);
+		printlatency(msg, lat_trace);
+		for (l = ALLOC; l <= REALLOC; l++)
+		    hist_merge(&lat_total[l], &lat_trace[l]);
+	    }
+	    if (jobs > 0) {
+		printf("\nTrace %d replayed on up to %d threads:\n", i, jobs);
+		printjobs(0, 0, 0, NULL, 0);
+		for (l = 0; l < nlevels; l++) {
+		    wall = eval_mm_jobs(trace, levels[l], job_secs);
+		    if (l == 0)
+			job_base = trace->num_ops / wall;
+		    printjobs(levels[l], (double)levels[l] * trace->num_ops,
+			      wall, job_secs, job_base);
+		    job_ops[l] += (double)levels[l] * trace->num_ops;
+		    job_wall[l] += wall;
+		}
+	    }
 	}
 	free_trace(trace);
     }
 
+    /* Time the traces, several at once, now that nothing else is running */
+    if (bench > 0) {
+	if (verbose > 1)
+	    printf("\nTiming the traces in pinned children\n");
+	bench_run();
+	for (i = 0; i < num_tracefiles; i++)
+	    if (mm_results[i].valid)
+		mm_results[i].secs = bench_results[i].mean;
+	printbench(num_tracefiles, mm_results, bench_results);
+    }
+
+    /* Display the latencies of all the traces together */
+    if (latency) {
+	printlatency("All traces", lat_total);
+	free(lat_trace);
+	free(lat_total);
+    }
+
+    /* Display the scaling of all the valid traces together */
+    if (jobs > 0) {
+	if (job_ops[0] > 0) {
+	    printf("\nAll valid traces replayed on up to %d threads:\n", jobs);
+	    printjobs(0, 0, 0, NULL, 0);
+	    for (l = 0; l < nlevels; l++)
+		printjobs(levels[l], job_ops[l], job_wall[l], NULL, 
+			  job_ops[0] / job_wall[0]);
+	}
+	free(job_secs);
+    }
+
     /* Display the mm results in a compact table */
     if (verbose) {
 	printf("\nResults for mm malloc:\n");
-	printresults(num_tracefiles, mm_stats);
+	printresults(num_tracefiles, mm_results);
 	printf("\n");
     }
 
@@ -279,10 +492,10 @@ int main(int argc, char **argv)
     util = 0;
     numcorrect = 0;
     for (i=0; i < num_tracefiles; i++) {
-	secs += mm_stats[i].secs;
-	ops += mm_stats[i].ops;
-	util += mm_stats[i].util;
-	if (mm_stats[i].valid)
+	secs += mm_results[i].secs;
+	ops += mm_results[i].ops;
+	util += mm_results[i].util;
+	if (mm_results[i].valid)
 	    numcorrect++;
     }
     avg_mm_util = util/num_tracefiles;
@@ -314,6 +527,11 @@ int main(int argc, char **argv)
 	printf("Terminated with %d errors\n", errors);
     }
 
+    if (json != NULL)
+	printjson(json, num_tracefiles, tracefiles, mm_results, bench_results,
+		  perfindex);
+    free(bench_results);
+
     if (autograder) {
 	printf("correct:%d\n", numcorrect);
 	printf("perfidx:%.0f\n", perfindex);
@@ -324,22 +542,39 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.  The tree
+ * is balanced, so each of these takes O(log n) time for n live blocks.
  ****************************************************************/
 
+/*
+ * range_cmp - Order ranges by address, treating ranges that overlap as
+ *     equal.  The ranges in a tree never overlap, so looking up a range
+ *     in it finds one that the range overlaps, if there is any.
+ */
+static int range_cmp(const void *a, const void *b)
+{
+    const range_t *p = a, *q = b;
+
+    if (p->hi < q->lo)
+	return -1;
+    if (p->lo > q->hi)
+	return 1;
+    return 0;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
-static int add_range(range_t **ranges, char *lo, int size, 
+static int add_range(void **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t key, *p, **node;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -352,9 +587,10 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or of a region */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -362,63 +598,50 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    key.lo = lo;
+    key.hi = hi;
+    if ((node = tfind(&key, ranges, range_cmp)) != NULL) {
+	p = *node;
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    if (tsearch(p, ranges, range_cmp) == NULL)
+	unix_error("tsearch error in add_range");
     return 1;
 }
 
 /* 
  * remove_range - Free the range record of block whose payload starts at lo 
- *
- * XXX alc: It's unclear what the variable "size" was used for.
  */
-static void remove_range(range_t **ranges, char *lo)
+static void remove_range(void **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    //int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            //size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    range_t key, *p, **node;
+
+    key.lo = key.hi = lo;
+    if ((node = tfind(&key, ranges, range_cmp)) == NULL || (*node)->lo != lo)
+	return;
+    p = *node;
+    tdelete(&key, ranges, range_cmp);
+    free(p);
 }
 
 /*
  * clear_ranges - free all of the range records for a trace 
  */
-static void clear_ranges(range_t **ranges)
+static void clear_ranges(void **ranges)
 {
-    range_t *p;
-    range_t *pnext;
-
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
-    }
+    tdestroy(*ranges, free);
     *ranges = NULL;
 }
 
@@ -428,7 +651,8 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory.  A binary trace
+ *     file is mapped instead, and its requests are used in place.
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
@@ -439,6 +663,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     unsigned index, size;
     unsigned max_index = 0;
     unsigned op_index;
+    tracehdr_t hdr;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
@@ -454,15 +679,22 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
-    fscanf(tracefile, "%u", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%u", &(trace->num_ids));     
-    fscanf(tracefile, "%u", &(trace->num_ops));     
-    fscanf(tracefile, "%u", &(trace->weight));        /* not used */
+    trace->map = NULL;
+    if (fread(&hdr, sizeof(hdr), 1, tracefile) == 1 &&
+	memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) == 0)
+	map_trace(trace, tracefile, path);
+    else {
+	rewind(tracefile);
+	fscanf(tracefile, "%u", &(trace->sugg_heapsize)); /* not used */
+	fscanf(tracefile, "%u", &(trace->num_ids));     
+	fscanf(tracefile, "%u", &(trace->num_ops));     
+	fscanf(tracefile, "%u", &(trace->weight));        /* not used */
     
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-	unix_error("malloc 2 failed in read_trace");
+	/* We'll store each request line in the trace in this array */
+	if ((trace->ops = 
+	     (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+	    unix_error("malloc 2 failed in read_trace");
+    }
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = 
@@ -473,6 +705,12 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace->block_sizes = 
 	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
 	unix_error("malloc 4 failed in read_trace");
+
+    /* A binary trace needs no parsing */
+    if (trace->map != NULL) {
+	fclose(tracefile);
+	return trace;
+    }
     
     /* read every request line in the trace file */
     index = 0;
@@ -497,6 +735,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = 0;
 	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
@@ -513,13 +752,65 @@ static trace_t *read_trace(char *tracedir, char *filename)
     return trace;
 }
 
+/*
+ * map_trace - Map the requests of the binary trace file tracefile, whose
+ *     header has been read, into trace, and check that each is well formed
+ */
+static void map_trace(trace_t *trace, FILE *tracefile, char *path)
+{
+    tracehdr_t *hdr;
+    traceop_t *op;
+    struct stat st;
+    unsigned i;
+
+    if (fstat(fileno(tracefile), &st) < 0)
+	unix_error("fstat failed in map_trace");
+    trace->mapsize = st.st_size;
+    if ((trace->map = mmap(NULL, trace->mapsize, PROT_READ, MAP_SHARED, 
+			   fileno(tracefile), 0)) == MAP_FAILED)
+	unix_error("mmap failed in map_trace");
+
+    /* Check the header, then stream the requests in as they are used */
+    hdr = (tracehdr_t *)trace->map;
+    if (hdr->order != TRACE_ORDER) {
+	sprintf(msg, "%s was written with another byte order", path);
+	app_error(msg);
+    }
+    if (hdr->num_ids == 0 || trace->mapsize != 
+	sizeof(tracehdr_t) + (size_t)hdr->num_ops * sizeof(traceop_t)) {
+	sprintf(msg, "%s is not a well-formed binary trace", path);
+	app_error(msg);
+    }
+    trace->sugg_heapsize = hdr->sugg_heapsize;
+    trace->num_ids = hdr->num_ids;
+    trace->num_ops = hdr->num_ops;
+    trace->weight = hdr->weight;
+    trace->ops = (traceop_t *)(hdr + 1);
+    madvise(trace->map, trace->mapsize, MADV_SEQUENTIAL);
+
+    /* Every request must name a known type and a block in the trace */
+    for (i = 0; i < trace->num_ops; i++) {
+	op = &trace->ops[i];
+	if ((op->type != ALLOC && op->type != FREE && op->type != REALLOC) ||
+	    op->index < 0 || (unsigned)op->index >= trace->num_ids) {
+	    sprintf(msg, "%s has a bad request at op %u", path, i);
+	    app_error(msg);
+	}
+    }
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace(), or
+ *              unmap the requests of a binary trace.
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    /* free the three arrays... */
+    if (trace->map != NULL)
+	munmap(trace->map, trace->mapsize);
+    else
+	free(trace->ops);
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
@@ -533,7 +824,7 @@ void free_trace(trace_t *trace)
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
+static int eval_mm_valid(trace_t *trace, int tracenum, void **ranges) 
 {
     unsigned i, j;
     int index;
@@ -543,7 +834,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *oldp;
     char *p;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
 
@@ -570,7 +861,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range tree if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
@@ -597,10 +888,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 		return 0;
 	    }
 	    
-	    /* Remove the old region from the range list */
+	    /* Remove the old region from the range tree */
 	    remove_range(ranges, oldp);
 	    
-	    /* Check new block for correctness and add it to range list */
+	    /* Check new block for correctness and add it to range tree */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 	    
@@ -612,7 +903,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -643,18 +934,124 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     return 1;
 }
 
+/*
+ * eval_mm_limits - Check that requests whose sizes are too large for
+ *     any heap fail, rather than wrap around to a small size and succeed.
+ *     Traces cannot hold such sizes, so they are tried here, once.
+ */
+static void eval_mm_limits(void)
+{
+    char *p, *newp;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_limits");
+
+    if (mm_malloc(SIZE_MAX) != NULL)
+	check_error("limits", "mm_malloc(SIZE_MAX) did not fail.");
+    if (mm_calloc(2, SIZE_MAX / 2 + 1) != NULL)
+	check_error("limits",
+	            "mm_calloc of more than SIZE_MAX bytes did not fail.");
+    if (mm_memalign(SIZE_MAX / 2 + 1, 1) != NULL)
+	check_error("limits", "mm_memalign to half of SIZE_MAX did not fail.");
+    if (mm_memalign(4096, SIZE_MAX) != NULL)
+	check_error("limits", "mm_memalign(4096, SIZE_MAX) did not fail.");
+    if (mm_memalign(4096, SIZE_MAX / 2) != NULL)
+	check_error("limits", "mm_memalign(4096, SIZE_MAX / 2) did not fail.");
+
+    /* A failed realloc leaves the old block alone */
+    if ((p = mm_malloc(100)) == NULL)
+	app_error("mm_malloc failed in eval_mm_limits");
+    if ((newp = mm_realloc(p, SIZE_MAX)) != NULL) {
+	check_error("limits", "mm_realloc(p, SIZE_MAX) did not fail.");
+	p = newp;
+    }
+    if ((newp = mm_realloc(p, SIZE_MAX - 16)) != NULL) {
+	check_error("limits", "mm_realloc(p, SIZE_MAX - 16) did not fail.");
+	p = newp;
+    }
+    mm_free(p);
+}
+
+/*
+ * eval_mm_defer - Check that deferred coalescing loses no block: after
+ *     the same requests, with half of the blocks freed by another thread,
+ *     as many bytes must be in use with MM_DEFER_COALESCE set as without
+ */
+static void eval_mm_defer(void)
+{
+    char **blocks, msg[MAXLINE];
+    size_t inuse, deferred;
+
+    if ((blocks = (char **)calloc(DEFER_BLOCKS, sizeof(char *))) == NULL)
+	unix_error("blocks calloc in eval_mm_defer failed");
+    inuse = defer_inuse(0, blocks);
+    deferred = defer_inuse(1, blocks);
+    if (!mm_mallopt(MM_DEFER_COALESCE, 0))
+	app_error("mm_mallopt(MM_DEFER_COALESCE) failed");
+    if (deferred != inuse) {
+	sprintf(msg, "%lu bytes in use with deferred coalescing, %lu without.",
+		(unsigned long)deferred, (unsigned long)inuse);
+	check_error("defer", msg);
+    }
+    free(blocks);
+}
+
+/*
+ * defer_inuse - Allocate DEFER_BLOCKS blocks on a fresh heap, with
+ *     deferred coalescing set if defer is, and free the even ones here
+ *     and the odd ones on another thread.  Returns the bytes left in use
+ *     once a large request has taken back the blocks of the other thread.
+ */
+static size_t defer_inuse(int defer, char **blocks)
+{
+    struct mm_stats st;
+    pthread_t tid;
+    int i;
+
+    if (!mm_mallopt(MM_DEFER_COALESCE, defer))
+	app_error("mm_mallopt(MM_DEFER_COALESCE) failed");
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_defer");
+    for (i = 0; i < DEFER_BLOCKS; i++)
+	if ((blocks[i] = mm_malloc(DEFER_SIZE)) == NULL)
+	    app_error("mm_malloc failed in eval_mm_defer");
+    for (i = 0; i < DEFER_BLOCKS; i += 2)
+	mm_free(blocks[i]);
+    if (pthread_create(&tid, NULL, defer_thread, blocks) != 0 ||
+	pthread_join(tid, NULL) != 0)
+	app_error("Could not run the thread of eval_mm_defer");
+    mm_free(mm_malloc(DEFER_FLUSH));
+    mm_stats(&st);
+    return st.heap_bytes - st.free_bytes - st.binned_bytes;
+}
+
+/*
+ * defer_thread - Free the odd blocks for defer_inuse
+ */
+static void *defer_thread(void *ptr)
+{
+    char **blocks = (char **)ptr;
+    int i;
+
+    for (i = 1; i < DEFER_BLOCKS; i += 2)
+	mm_free(blocks[i]);
+    return NULL;
+}
+
 /* 
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   Utilization is the ratio hwm/footprint, where footprint is the 
+ *   peak number of bytes that the student's malloc package held in 
+ *   the heap and in regions from mem_map() while running the trace.
+ *   Regions can be unmapped, so the footprint at the end of the trace
+ *   can be less than its peak.
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, void **ranges)
 {   
     unsigned i;
     int index;
@@ -737,7 +1134,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_footprint());
 }
 
 
@@ -747,8 +1144,6 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    unsigned i, index, size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     /* Reset the heap and initialize the mm package */
@@ -756,7 +1151,18 @@ static void eval_mm_speed(void *ptr)
     if (mm_init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
 
-    /* Interpret each trace request */
+    replay_trace(trace, trace->blocks);
+}
+
+/*
+ * replay_trace - Interpret each request of a trace, keeping the blocks
+ *    that it allocates in blocks
+ */
+static void replay_trace(trace_t *trace, char **blocks)
+{
+    unsigned i, index, size, newsize;
+    char *p, *newp, *oldp, *block;
+
     for (i = 0;  i < trace->num_ops;  i++)
         switch (trace->ops[i].type) {
 
@@ -764,30 +1170,302 @@ static void eval_mm_speed(void *ptr)
             index = trace->ops[i].index;
             size = trace->ops[i].size;
             if ((p = mm_malloc(size)) == NULL)
-		app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
+		app_error("mm_malloc error in replay_trace");
+            blocks[index] = p;
             break;
 
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
-	    oldp = trace->blocks[index];
+	    oldp = blocks[index];
             if ((newp = mm_realloc(oldp,newsize)) == NULL)
-		app_error("mm_realloc error in eval_mm_speed");
-            trace->blocks[index] = newp;
+		app_error("mm_realloc error in replay_trace");
+            blocks[index] = newp;
             break;
 
         case FREE: /* mm_free */
             index = trace->ops[i].index;
-            block = trace->blocks[index];
+            block = blocks[index];
             mm_free(block);
             break;
 
 	default:
-	    app_error("Nonexistent request type in eval_mm_valid");
+	    app_error("Nonexistent request type in replay_trace");
         }
 }
 
+/*
+ * eval_mm_stats - Replay the trace over a fresh heap, and print a timeline
+ *    of the allocator's mm_stats every so many requests and after the last
+ *    one.  With -V, also print the free blocks by size class at the end.
+ */
+static void eval_mm_stats(trace_t *trace, int tracenum, int every)
+{
+    unsigned i, index, size;
+    size_t live = 0, requested = 0;
+    struct mm_stats st, prev;
+    char *p;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_stats");
+
+    printf("\nTrace %d heap timeline, every %d requests:\n", tracenum, every);
+    memset(&prev, 0, sizeof(prev));
+    printsample(0, NULL, NULL, 0, 0);
+    for (i = 0; i < trace->num_ops; i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	switch (trace->ops[i].type) {
+
+	case ALLOC: /* mm_malloc */
+	    if ((p = mm_malloc(size)) == NULL)
+		app_error("mm_malloc failed in eval_mm_stats");
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    live += size;
+	    requested += size;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+		app_error("mm_realloc failed in eval_mm_stats");
+	    live += size - trace->block_sizes[index];
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    requested += size;
+	    break;
+
+	case FREE: /* mm_free */
+	    mm_free(trace->blocks[index]);
+	    live -= trace->block_sizes[index];
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_stats");
+	}
+
+	if ((i + 1) % every == 0 || i + 1 == trace->num_ops) {
+	    mm_stats(&st);
+	    printsample(i + 1, &st, &prev, live, requested);
+	    prev = st;
+	    requested = 0;
+	}
+    }
+    if (verbose > 1)
+	printclasses(&st);
+}
+
+/*
+ * eval_mm_latency - Replay the trace over a fresh heap, timing every
+ *    request with the cycle counter, and replace hists, which is indexed
+ *    by type of request, with the histograms of their latencies
+ */
+static void eval_mm_latency(trace_t *trace, hist_t *hists)
+{
+    unsigned i, index;
+    char *p;
+
+    memset(hists, 0, (REALLOC + 1) * sizeof(hist_t));
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	switch (trace->ops[i].type) {
+	case ALLOC: /* mm_malloc */
+	    start_counter();
+	    p = mm_malloc(trace->ops[i].size);
+	    hist_add(&hists[ALLOC], get_counter());
+	    if (p == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    start_counter();
+	    p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+	    hist_add(&hists[REALLOC], get_counter());
+	    if (p == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case FREE: /* mm_free */
+	    p = trace->blocks[index];
+	    start_counter();
+	    mm_free(p);
+	    hist_add(&hists[FREE], get_counter());
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+	}
+    }
+}
+
+/*
+ * hist_add - Count a latency of the given number of cycles in hist
+ */
+static void hist_add(hist_t *hist, double cycles)
+{
+    uint64_t v = (cycles < 1) ? 0 : (uint64_t)cycles;
+    int e;
+
+    if (v >= (uint64_t)1 << LAT_MAX_BITS)
+	v = ((uint64_t)1 << LAT_MAX_BITS) - 1;
+    if (v < LAT_SUB)
+	hist->counts[v]++;
+    else {
+	/* Keep the top LAT_SUB_BITS + 1 bits of v */
+	e = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+	hist->counts[(e + 1) * LAT_SUB + (v >> e) - LAT_SUB]++;
+    }
+    hist->n++;
+    if (cycles > hist->max)
+	hist->max = cycles;
+}
+
+/*
+ * hist_merge - Add the latencies counted in hist to those in into
+ */
+static void hist_merge(hist_t *into, hist_t *hist)
+{
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+	into->counts[b] += hist->counts[b];
+    into->n += hist->n;
+    if (hist->max > into->max)
+	into->max = hist->max;
+}
+
+/*
+ * hist_value - Return the latency below which the given fraction of the
+ *    latencies in hist lie, as the upper bound of the bucket that holds
+ *    it, but no more than the largest latency
+ */
+static double hist_value(hist_t *hist, double fraction)
+{
+    unsigned long seen = 0, rank = (unsigned long)(fraction * hist->n);
+    double bound;
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++) {
+	if ((seen += hist->counts[b]) > rank || seen == hist->n) {
+	    if (b < LAT_SUB)
+		bound = b;
+	    else
+		bound = (double)((((uint64_t)(b % LAT_SUB + LAT_SUB + 1)) <<
+				  (b / LAT_SUB - 1)) - 1);
+	    return (bound < hist->max) ? bound : hist->max;
+	}
+    }
+    return 0;
+}
+
+/*
+ * job_levels - Fill levels with the thread counts to replay traces on:
+ *    the powers of two below maxjobs, and maxjobs.  Returns their number.
+ */
+static int job_levels(int maxjobs, int *levels)
+{
+    int n = 0, njobs;
+
+    for (njobs = 1; njobs < maxjobs && n < JOB_LEVELS - 1; njobs *= 2)
+	levels[n++] = njobs;
+    levels[n++] = maxjobs;
+    return n;
+}
+
+/*
+ * eval_mm_jobs - Replay the trace on njobs threads at once, each with
+ *    its own blocks, JOB_REPS times over a fresh heap.  Returns the wall
+ *    clock time of the fastest replay, from the first thread's start to
+ *    the last thread's end, and leaves the time taken by each of its
+ *    threads in secs.
+ */
+static double eval_mm_jobs(trace_t *trace, int njobs, double *secs)
+{
+    pthread_t *tids;
+    job_t *jobs;
+    pthread_barrier_t barrier;
+    double start, end, best = DBL_MAX;
+    int i, rep;
+
+    if ((tids = (pthread_t *)calloc(njobs, sizeof(pthread_t))) == NULL ||
+	(jobs = (job_t *)calloc(njobs, sizeof(job_t))) == NULL)
+	unix_error("calloc in eval_mm_jobs failed");
+    for (i = 0; i < njobs; i++) {
+	jobs[i].trace = trace;
+	jobs[i].barrier = &barrier;
+	if ((jobs[i].blocks = 
+	     (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+	    unix_error("blocks calloc in eval_mm_jobs failed");
+    }
+
+    for (rep = 0; rep < JOB_REPS; rep++) {
+	/* mm_init must not run while any other thread is in the allocator */
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_jobs");
+
+	/* The threads start together once every one of them is ready */
+	pthread_barrier_init(&barrier, NULL, njobs);
+	for (i = 0; i < njobs; i++)
+	    if ((errno = pthread_create(&tids[i], NULL, job_thread, 
+					&jobs[i])) != 0)
+		unix_error("pthread_create in eval_mm_jobs failed");
+	start = DBL_MAX;
+	end = 0;
+	for (i = 0; i < njobs; i++) {
+	    pthread_join(tids[i], NULL);
+	    start = (jobs[i].start < start) ? jobs[i].start : start;
+	    end = (jobs[i].end > end) ? jobs[i].end : end;
+	}
+	pthread_barrier_destroy(&barrier);
+
+	if (end - start < best) {
+	    best = end - start;
+	    for (i = 0; i < njobs; i++)
+		secs[i] = jobs[i].end - jobs[i].start;
+	}
+    }
+
+    for (i = 0; i < njobs; i++)
+	free(jobs[i].blocks);
+    free(jobs);
+    free(tids);
+    return best;
+}
+
+/*
+ * job_thread - Replay one thread's share of a threaded replay, timing it
+ *    from the moment that every thread is ready
+ */
+static void *job_thread(void *ptr)
+{
+    job_t *job = (job_t *)ptr;
+
+    pthread_barrier_wait(job->barrier);
+    job->start = wall_secs();
+    replay_trace(job->trace, job->blocks);
+    job->end = wall_secs();
+    return NULL;
+}
+
+/*
+ * wall_secs - Return the time, in seconds, on a clock that never jumps
+ */
+static double wall_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -852,6 +1530,262 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printbench - Print the timed runs of each valid trace: how many there
+ *     were, the CPU they were pinned to, their mean seconds, the half-width
+ *     of its 95% confidence interval as a share of the mean, the Kops and
+ *     the cycles at the mean, and the same for all the traces together
+ */
+static void printbench(int n, stats_t *stats, bench_t *bench)
+{
+    int i;
+    double secs = 0, var = 0, ops = 0, cycles = 0;
+
+    printf("\nTimed runs of mm malloc, after %d untimed per trace:\n",
+	   BENCH_WARMUP);
+    printf("%5s %5s %4s %10s %7s %8s %10s\n", 
+	   "trace", "runs", "cpu", "secs", "+/-95%", "Kops", "Kcycles");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	printf("%5d %5d %4d %10.6f %6.1f%% %8.0f %10.1f\n",
+	       i, bench[i].n, bench[i].cpu, bench[i].mean, 
+	       100.0 * bench[i].ci / bench[i].mean,
+	       (stats[i].ops/1e3)/bench[i].mean, bench[i].cycles/1e3);
+	secs += bench[i].mean;
+	var += bench[i].ci * bench[i].ci;
+	ops += stats[i].ops;
+	cycles += bench[i].cycles;
+    }
+
+    /* The traces are timed independently, so their variances add */
+    if (secs > 0)
+	printf("%16s %10.6f %6.1f%% %8.0f %10.1f\n", "Total", secs, 
+	       100.0 * sqrt(var) / secs, (ops/1e3)/secs, cycles/1e3);
+}
+
+/*
+ * printjson - Write the results of every trace, the times of each of its
+ *     timed runs if bench is given, and the totals, to the file at path
+ *     as a JSON object
+ */
+static void printjson(char *path, int n, char **tracefiles, stats_t *stats,
+		      bench_t *bench, double perfindex)
+{
+    FILE *fp;
+    int i, j;
+    double secs = 0, var = 0, ops = 0, util = 0;
+
+    if ((fp = fopen(path, "w")) == NULL)
+	unix_error("Could not create the JSON file");
+    fprintf(fp, "{\n  \"thread_safe\": %s,\n", 
+	    mm_thread_safe() ? "true" : "false");
+    fprintf(fp, "  \"warmup_runs\": %d,\n", BENCH_WARMUP);
+    fprintf(fp, "  \"traces\": [");
+    for (i = 0; i < n; i++) {
+	fprintf(fp, "%s\n    {\"name\": ", i > 0 ? "," : "");
+	printjsonstr(fp, tracefiles[i]);
+	fprintf(fp, ", \"valid\": %s, \"ops\": %.0f", 
+		stats[i].valid ? "true" : "false", stats[i].ops);
+	if (!stats[i].valid) {
+	    fprintf(fp, "}");
+	    continue;
+	}
+	fprintf(fp, ", \"util\": %.6f, \"cpu\": %d, \"timed_runs\": %d,\n",
+		stats[i].util, bench[i].cpu, bench[i].n);
+	fprintf(fp, "     \"secs\": %.9f, \"secs_ci95\": %.9f, "
+		"\"secs_stddev\": %.9f,\n", 
+		bench[i].mean, bench[i].ci, bench[i].stddev);
+	fprintf(fp, "     \"secs_min\": %.9f, \"secs_max\": %.9f, "
+		"\"kops\": %.3f, \"cycles\": %.0f,\n",
+		bench[i].min, bench[i].max, 
+		(stats[i].ops/1e3)/bench[i].mean, bench[i].cycles);
+	fprintf(fp, "     \"runs\": [");
+	for (j = 0; j < bench[i].n; j++)
+	    fprintf(fp, "%s%.9f", j > 0 ? ", " : "", bench[i].secs[j]);
+	fprintf(fp, "]}");
+	secs += bench[i].mean;
+	var += bench[i].ci * bench[i].ci;
+	ops += stats[i].ops;
+	util += stats[i].util;
+    }
+    fprintf(fp, "\n  ],\n  \"total\": {\"valid\": %s, \"util\": %.6f, "
+	    "\"ops\": %.0f,\n", errors == 0 ? "true" : "false", util / n, ops);
+    fprintf(fp, "    \"secs\": %.9f, \"secs_ci95\": %.9f, \"kops\": %.3f, "
+	    "\"perf_index\": %.3f}\n}\n", secs, sqrt(var),
+	    secs > 0 ? (ops/1e3)/secs : 0.0, perfindex);
+    if (fclose(fp) != 0)
+	unix_error("Could not write the JSON file");
+}
+
+/*
+ * printjsonstr - Write str to fp as a JSON string
+ */
+static void printjsonstr(FILE *fp, char *str)
+{
+    unsigned char *p;
+
+    putc('"', fp);
+    for (p = (unsigned char *)str; *p != '\0'; p++) {
+	if (*p == '"' || *p == '\\')
+	    fprintf(fp, "\\%c", *p);
+	else if (*p < 0x20)
+	    fprintf(fp, "\\u%04x", *p);
+	else
+	    putc(*p, fp);
+    }
+    putc('"', fp);
+}
+
+/*
+ * printnodes - Print how much of the memory held by the heaps and regions
+ *     is resident on each NUMA node, at the end of trace tracenum
+ */
+static void printnodes(int tracenum)
+{
+    int i, nodes = mem_node_count();
+    size_t *bytes;
+
+    if ((bytes = (size_t *)calloc(nodes, sizeof(size_t))) == NULL)
+	unix_error("bytes calloc in printnodes failed");
+    mem_node_usage(bytes);
+    printf("Trace %d resident KB by node:", tracenum);
+    for (i = 0; i < nodes; i++)
+	printf(" %d:%zu", i, bytes[i] / 1024);
+    printf("\n");
+    free(bytes);
+}
+
+/*
+ * printsample - Print a row of a heap timeline for the stats st, taken
+ *     after op requests, with live bytes allocated, or the header if st is
+ *     NULL.  The events and the bytes requested are counted since prev,
+ *     the previous sample.  frag is the share of the free bytes outside
+ *     the largest free block, probes the average free blocks examined per
+ *     fit, and round the bytes added by rounding requests up, as a share
+ *     of the bytes requested.
+ */
+static void printsample(unsigned op, struct mm_stats *st, 
+			struct mm_stats *prev, size_t live, size_t requested)
+{
+    unsigned long fits;
+
+    if (st == NULL) {
+	printf("%9s %9s %5s %9s %7s %9s %5s %7s %7s %6s %5s\n", "ops", 
+	       "heap KB", "util", "free KB", "free", "largest", "frag", 
+	       "splits", "merges", "probes", "round");
+	return;
+    }
+    fits = st->fits - prev->fits;
+    printf("%9u %9zu %4.0f%% %9zu %7zu %9zu %4.0f%% %7lu %7lu %6.1f %4.0f%%\n",
+	   op, st->heap_bytes / 1024, 
+	   st->heap_bytes ? 100.0 * live / st->heap_bytes : 0.0,
+	   st->free_bytes / 1024, st->free_blocks, st->largest_free,
+	   st->free_bytes ? 
+	   100.0 * (st->free_bytes - st->largest_free) / st->free_bytes : 0.0,
+	   st->splits - prev->splits, st->coalesces - prev->coalesces,
+	   fits ? (double)(st->fit_probes - prev->fit_probes) / fits : 0.0,
+	   requested ? 100.0 * (st->round_bytes - prev->round_bytes) / 
+	   requested : 0.0);
+}
+
+/*
+ * printclasses - Print the free blocks in each nonempty size class of the
+ *     stats st
+ */
+static void printclasses(struct mm_stats *st)
+{
+    int i;
+
+    printf("Free blocks by size class:\n");
+    printf("%9s %9s %9s %6s\n", "min size", "blocks", "KB", "share");
+    for (i = 0; i < st->classes; i++) {
+	if (st->class_blocks[i] == 0)
+	    continue;
+	printf("%8zu%c %9zu %9zu %5.1f%%\n", st->class_min[i], 
+	       i == st->classes - 1 ? '+' : ' ', st->class_blocks[i],
+	       st->class_bytes[i] / 1024, 
+	       100.0 * st->class_bytes[i] / st->free_bytes);
+    }
+}
+
+/*
+ * printlatency - Print the percentiles of the latencies of each type of
+ *     request in hists, under a title.  With -V, also print every nonempty
+ *     bucket of each histogram.
+ */
+static void printlatency(char *title, hist_t *hists)
+{
+    static char *names[] = {"malloc", "free", "realloc"};
+    hist_t *hist;
+    unsigned long seen;
+    int t, b;
+
+    printf("\n%s latency in cycles:\n", title);
+    printf("%8s %9s %8s %8s %8s %8s %10s\n", 
+	   "request", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (t = ALLOC; t <= REALLOC; t++) {
+	hist = &hists[t];
+	if (hist->n == 0)
+	    continue;
+	printf("%8s %9lu %8.0f %8.0f %8.0f %8.0f %10.0f\n",
+	       names[t], hist->n,
+	       hist_value(hist, 0.5), hist_value(hist, 0.9),
+	       hist_value(hist, 0.99), hist_value(hist, 0.999), hist->max);
+    }
+    if (verbose < 2)
+	return;
+    for (t = ALLOC; t <= REALLOC; t++) {
+	hist = &hists[t];
+	if (hist->n == 0)
+	    continue;
+	printf("%s: %10s %9s %10s\n", names[t], "cycles <=", "count",
+	       "percentile");
+	for (b = 0, seen = 0; b < LAT_BUCKETS; b++) {
+	    if (hist->counts[b] == 0)
+		continue;
+	    seen += hist->counts[b];
+	    printf("%*s  %10.0f %9lu %9.3f%%\n", (int)strlen(names[t]), "",
+		   hist_value(hist, (double)(seen - 1) / hist->n),
+		   hist->counts[b], 100.0 * seen / hist->n);
+	}
+    }
+}
+
+/*
+ * printjobs - Print a row of a scaling table: the aggregate Kops of ops
+ *     requests shared by njobs threads in wall seconds, its efficiency
+ *     relative to base ops/sec on one thread, and the Kops of each thread
+ *     if secs is given.  Prints the table's header if njobs is zero.  A
+ *     rate whose time is too short to measure is printed as "-".
+ */
+static void printjobs(int njobs, double ops, double wall, double *secs,
+		      double base)
+{
+    int i;
+
+    if (njobs == 0) {
+	printf("%7s %10s %10s  %s\n", 
+	       "threads", "Kops", "efficiency", "Kops per thread");
+	return;
+    }
+    if (wall > 0 && base > 0)
+	printf("%7d %10.0f %9.0f%% ", 
+	       njobs, 
+	       (ops/1e3)/wall,
+	       100.0*(ops/wall)/(njobs*base));
+    else
+	printf("%7d %10s %10s ", njobs, "-", "-");
+    if (secs != NULL)
+	for (i = 0; i < njobs; i++) {
+	    if (secs[i] > 0)
+		printf(" %.0f", (ops/njobs/1e3)/secs[i]);
+	    else
+		printf(" -");
+	}
+    printf("\n");
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -870,6 +1804,16 @@ void unix_error(char *msg)
     exit(1);
 }
 
+/*
+ * check_error - Report a failure of one of the checks run before the
+ *     traces, such as a request that should have failed but did not
+ */
+void check_error(char *check, char *msg)
+{
+    errors++;
+    printf("ERROR [%s]: %s\n", check, msg);
+}
+
 /*
  * malloc_error - Report an error returned by the mm_malloc package
  */
@@ -884,12 +1828,26 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-aghvV] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-aghlnvV] [-b <n>] [-c <n>] [-f <file>] [-j <n>]\n");
+    fprintf(stderr, "               [-J <file>] [-s <n>] [-t <dir>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-b <n>     Time <n> runs of each trace in a child pinned\n");
+    fprintf(stderr, "\t           to a CPU, timing traces on all CPUs at once.\n");
+    fprintf(stderr, "\t-c <n>     Check part of the heap every <n> calls.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Also replay each trace on up to <n> threads\n");
+    fprintf(stderr, "\t           at once, and print how it scales.\n");
+    fprintf(stderr, "\t-J <file>  Write the results to <file> as JSON, timing\n");
+    fprintf(stderr, "\t           the traces as -b does.\n");
+    fprintf(stderr, "\t-l         Time every request, and print latency\n");
+    fprintf(stderr, "\t           percentiles for each type of request.\n");
+    fprintf(stderr, "\t-n         Bind arenas to NUMA nodes, and print the\n");
+    fprintf(stderr, "\t           memory on each node after every trace.\n");
+    fprintf(stderr, "\t-s <n>     Print a timeline of the heap's statistics,\n");
+    fprintf(stderr, "\t           sampled every <n> requests.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
@@ -2,36 +2,145 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            The simulated memory is divided into MAX_ARENAS independent
+ *            arenas of MEM_ARENA_SIZE bytes each, and every arena has its
+ *            own brk pointer.  The arenas are reserved without access, and
+ *            each is made accessible MEM_COMMIT_SIZE bytes at a time as
+ *            its brk rises, so that the arenas can be made large enough
+ *            to back a real process's heap.  The original single-heap
+ *            interface (mem_sbrk, mem_heap_lo, ...) operates on arena 0.
+ *            Callers must serialize calls that operate on the same arena.
+ *
+ *            Blocks too large for a heap can instead be given regions of
+ *            their own with mem_map, which are real mappings outside the
+ *            arenas.  Callers must serialize calls to mem_map and
+ *            mem_unmap.  The regions are kept in a hash table by start
+ *            address, so that unmapping one takes constant time however
+ *            many there are.  The footprint, the bytes held by all heaps
+ *            and regions together, and its peak are tracked across both.
+ *
+ *            On a NUMA machine, an arena can be bound to a node so that
+ *            its pages are placed there, and the resident bytes of the
+ *            heaps and regions can be counted per node.
+ *
+ *            Nothing here calls the C library's malloc, so the same module
+ *            can serve as the memory system of a process whose malloc is
+ *            the student's package (see mmpreload.c).
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "memlib.h"
 #include "config.h"
 
+#ifdef SYS_mbind
+#include <linux/mempolicy.h>
+#endif
+
+/* Granularity at which an arena is made accessible as its brk rises */
+#define MEM_COMMIT_SIZE (1 << 20)
+
+/* Most NUMA nodes supported, the bits in a node mask */
+#define MEM_MAX_NODES (8 * (int)sizeof(unsigned long))
+
+/* Pages queried per call when counting resident pages by node */
+#define MEM_NODE_BATCH 512
+
+/*
+ * How the pages above a shrunken heap are given back.  MADV_FREE lets the
+ * system reclaim them lazily, which is cheaper if the heap soon grows back.
+ */
+#ifdef MADV_FREE
+#define MEM_RELEASE MADV_FREE
+#else
+#define MEM_RELEASE MADV_DONTNEED
+#endif
+
+/*
+ * Failed requests are reported on stderr, except under MEM_QUIET, where
+ * memlib is the memory system of another program (as in libmm.so), and
+ * the program reports the failures it cares about itself.
+ */
+#ifdef MEM_QUIET
+#define MEM_ERROR(msg)
+#else
+#define MEM_ERROR(msg) fprintf(stderr, "%s\n", msg)
+#endif
+
+/* The state of one arena */
+typedef struct {
+    char *start_brk;  /* points to first byte of heap */
+    char *brk;        /* points to last byte of heap */
+    char *max_addr;   /* largest legal heap address */ 
+    char *fresh;      /* first byte never yet covered by the heap */
+    char *committed;  /* first byte that is not yet accessible */
+    int node;         /* NUMA node the arena is bound to, or -1 */
+} arena_t;
+
+/* Multiplier that scatters the page numbers of regions over the buckets */
+#define MEM_HASH_MULT 0x9e3779b97f4a7c15ULL
+
+/* A region returned by mem_map */
+typedef struct region {
+    char *start;          /* first byte of the region */
+    size_t size;          /* size of the region in bytes */
+    struct region *next;  /* next region in the same bucket */
+} region_t;
+
 /* private variables */
-static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_start;                /* first byte of all arenas */
+static arena_t mem_arenas[MAX_ARENAS]; /* the arenas, in address order */
+static region_t **mem_buckets;         /* the regions, by hash of start */
+static size_t mem_nbuckets;            /* buckets, a power of 2, or 0 */
+static int mem_bucket_shift;           /* 64 - log2(mem_nbuckets) */
+static size_t mem_nregions;            /* regions in the buckets */
+static region_t *mem_spare_regions;    /* unused region_t structs */
+static size_t mem_footprint_now;       /* bytes held by heaps and regions */
+static size_t mem_footprint_peak;      /* most bytes held since reset */
+static int mem_nodes;                  /* NUMA nodes, or 0 until counted */
+
+static region_t *mem_region_new(void);
+static region_t **mem_bucket(const void *start);
+static int mem_grow_buckets(void);
+static void mem_add_footprint(intptr_t incr);
+static void mem_node_tally(char *lo, size_t size, size_t *bytes);
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    int i;
+
+    /* 
+     * Reserve the storage we will use to model the available VM.  Pages
+     * are only made accessible, and so backed by memory, once an arena's
+     * brk passes over them.
+     */
+    mem_start = mmap(NULL, (size_t)MAX_ARENAS * MEM_ARENA_SIZE, PROT_NONE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    for (i = 0; i < MAX_ARENAS; i++) {
+	mem_arenas[i].start_brk = mem_start + (size_t)i * MEM_ARENA_SIZE;
+	mem_arenas[i].max_addr = mem_arenas[i].start_brk + MEM_ARENA_SIZE;
+	mem_arenas[i].brk = mem_arenas[i].start_brk; /* empty initially */
+	mem_arenas[i].fresh = mem_arenas[i].start_brk;
+	mem_arenas[i].committed = mem_arenas[i].start_brk;
+	mem_arenas[i].node = -1;
+    }
 }
 
 /* 
@@ -39,33 +148,37 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_reset_brk();
+    munmap(mem_start, (size_t)MAX_ARENAS * MEM_ARENA_SIZE);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers to make empty heaps,
+ *    and unmap every region
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    size_t b;
+    int i;
+
+    for (i = 0; i < MAX_ARENAS; i++)
+	mem_arenas[i].brk = mem_arenas[i].start_brk;
+    for (b = 0; b < mem_nbuckets; b++)
+	while (mem_buckets[b] != NULL)
+	    mem_unmap(mem_buckets[b]->start);
+    mem_footprint_now = 0;
+    mem_footprint_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A 
+ *    negative incr shrinks the heap, and the pages wholly above the new
+ *    brk are given back to the system.
  */
 void *mem_sbrk(intptr_t incr) 
 {
-    char *old_brk = mem_brk;
-
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
-	errno = ENOMEM;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
-	return (void *)-1;
-    }
-    mem_brk += incr;
-    return (void *)old_brk;
+    return mem_arena_sbrk(0, incr);
 }
 
 /*
@@ -73,7 +186,7 @@ void *mem_sbrk(intptr_t incr)
  */
 void *mem_heap_lo()
 {
-    return (void *)mem_start_brk;
+    return mem_arena_lo(0);
 }
 
 /* 
@@ -81,7 +194,7 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return mem_arena_hi(0);
 }
 
 /*
@@ -89,7 +202,7 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return mem_arena_heapsize(0);
 }
 
 /*
@@ -99,3 +212,469 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * mem_arena_count - return the number of arenas
+ */
+int mem_arena_count(void)
+{
+    return MAX_ARENAS;
+}
+
+/*
+ * mem_arena_maxsize - return the largest size in bytes that an arena's
+ *    heap can grow to
+ */
+size_t mem_arena_maxsize(void)
+{
+    return MEM_ARENA_SIZE;
+}
+
+/*
+ * mem_arena_of - return the arena whose heap contains address p, or -1 if
+ *    p lies in no arena's heap
+ */
+int mem_arena_of(const void *p)
+{
+    const char *cp = p;
+    int i;
+
+    if (cp < mem_start || 
+	cp >= mem_start + (size_t)MAX_ARENAS * MEM_ARENA_SIZE)
+	return -1;
+    i = (int)((size_t)(cp - mem_start) / MEM_ARENA_SIZE);
+    return (cp < mem_arenas[i].brk) ? i : -1;
+}
+
+/* 
+ * mem_arena_sbrk - mem_sbrk for arena "arena"
+ */
+void *mem_arena_sbrk(int arena, intptr_t incr) 
+{
+    size_t pagesize = mem_pagesize();
+    arena_t *a;
+    char *old_brk, *release, *commit;
+
+    assert(arena >= 0 && arena < MAX_ARENAS);
+    a = &mem_arenas[arena];
+    old_brk = a->brk;
+    if (incr < 0 && -incr > a->brk - a->start_brk) {
+	errno = EINVAL;
+	MEM_ERROR("ERROR: mem_sbrk failed. Heap would be negative...");
+	return (void *)-1;
+    }
+    if (incr > a->max_addr - a->brk) {
+	errno = ENOMEM;
+	MEM_ERROR("ERROR: mem_sbrk failed. Ran out of memory...");
+	return (void *)-1;
+    }
+    if (a->brk + incr > a->committed) {
+	/* Make the pages up to the new brk accessible, a chunk at a time. */
+	commit = a->start_brk + ((size_t)(a->brk + incr - a->start_brk) +
+				 MEM_COMMIT_SIZE - 1) / MEM_COMMIT_SIZE * 
+	    MEM_COMMIT_SIZE;
+	if (commit > a->max_addr)
+	    commit = a->max_addr;
+	if (mprotect(a->committed, (size_t)(commit - a->committed), 
+		     PROT_READ | PROT_WRITE) != 0) {
+	    errno = ENOMEM;
+	    MEM_ERROR("ERROR: mem_sbrk failed. Ran out of memory...");
+	    return (void *)-1;
+	}
+	a->committed = commit;
+    }
+    a->brk += incr;
+    if (a->brk > a->fresh)
+	a->fresh = a->brk;
+    if (incr < 0) {
+	/* The backing store keeps no pages that the heap no longer covers. */
+	release = a->start_brk + ((size_t)(a->brk - a->start_brk) + 
+				  pagesize - 1) / pagesize * pagesize;
+	if (release < old_brk)
+	    madvise(release, (size_t)(old_brk - release), MEM_RELEASE);
+    }
+    mem_add_footprint(incr);
+    return (void *)old_brk;
+}
+
+/*
+ * mem_arena_lo - return address of the first byte of arena "arena"
+ */
+void *mem_arena_lo(int arena)
+{
+    return (void *)mem_arenas[arena].start_brk;
+}
+
+/* 
+ * mem_arena_hi - return address of the last byte of arena "arena"
+ */
+void *mem_arena_hi(int arena)
+{
+    return (void *)(mem_arenas[arena].brk - 1);
+}
+
+/*
+ * mem_arena_heapsize - returns the size of arena "arena" in bytes
+ */
+size_t mem_arena_heapsize(int arena)
+{
+    return (size_t)(mem_arenas[arena].brk - mem_arenas[arena].start_brk);
+}
+
+/*
+ * mem_arena_fresh - return the address above which arena "arena" has never
+ *    been part of the heap.  Those bytes still read as zero; shrinking or
+ *    resetting the heap leaves whatever was written below it in place.
+ */
+void *mem_arena_fresh(int arena)
+{
+    return (void *)mem_arenas[arena].fresh;
+}
+
+/*
+ * mem_map - map a region of at least size bytes, rounded up to a whole
+ *    number of pages, and return its start address
+ */
+void *mem_map(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    region_t *r, **rp;
+    char *start;
+
+    if (size > SIZE_MAX - pagesize) {
+	errno = ENOMEM;
+	return (void *)-1;
+    }
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+
+    /* A table that cannot grow only gets longer chains, if it exists */
+    if (mem_nregions >= mem_nbuckets && mem_grow_buckets() < 0 &&
+	mem_nbuckets == 0)
+	return (void *)-1;
+    if ((r = mem_region_new()) == NULL)
+	return (void *)-1;
+    start = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED) {
+	r->next = mem_spare_regions;
+	mem_spare_regions = r;
+	MEM_ERROR("ERROR: mem_map failed. Ran out of memory...");
+	return (void *)-1;
+    }
+    r->start = start;
+    r->size = size;
+    rp = mem_bucket(start);
+    r->next = *rp;
+    *rp = r;
+    mem_nregions++;
+    mem_add_footprint((intptr_t)size);
+    return (void *)start;
+}
+
+/*
+ * mem_unmap - unmap the region that starts at address start
+ */
+void mem_unmap(void *start)
+{
+    region_t **rp, *r;
+
+    assert(mem_nbuckets > 0);
+    for (rp = mem_bucket(start); *rp != NULL; rp = &(*rp)->next) {
+	if ((*rp)->start == start) {
+	    r = *rp;
+	    *rp = r->next;
+	    mem_nregions--;
+	    munmap(r->start, r->size);
+	    mem_add_footprint(-(intptr_t)r->size);
+	    r->next = mem_spare_regions;
+	    mem_spare_regions = r;
+	    return;
+	}
+    }
+    assert(0);
+}
+
+/*
+ * mem_mapped - return 1 if the bytes lo through hi lie in one region, and
+ *    0 otherwise
+ */
+int mem_mapped(const void *lo, const void *hi)
+{
+    region_t *r;
+    size_t b;
+
+    for (b = 0; b < mem_nbuckets; b++) {
+	for (r = mem_buckets[b]; r != NULL; r = r->next) {
+	    if ((const char *)lo >= r->start && 
+		(const char *)hi < r->start + r->size)
+		return 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * mem_mapsize - returns the total size of the regions in bytes
+ */
+size_t mem_mapsize(void)
+{
+    region_t *r;
+    size_t size = 0, b;
+
+    for (b = 0; b < mem_nbuckets; b++)
+	for (r = mem_buckets[b]; r != NULL; r = r->next)
+	    size += r->size;
+    return size;
+}
+
+/*
+ * mem_footprint - returns the bytes held by all heaps and regions
+ */
+size_t mem_footprint(void)
+{
+    return __atomic_load_n(&mem_footprint_now, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_peak_footprint - returns the largest footprint since the last
+ *    mem_reset_brk
+ */
+size_t mem_peak_footprint(void)
+{
+    return __atomic_load_n(&mem_footprint_peak, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_node_count - return the number of NUMA nodes, which is 1 if the
+ *    system does not say
+ */
+int mem_node_count(void)
+{
+    char buf[256], *p, *end;
+    ssize_t len;
+    long n;
+    int fd, nodes = __atomic_load_n(&mem_nodes, __ATOMIC_RELAXED);
+
+    if (nodes > 0)
+	return nodes;
+
+    /* 
+     * The online nodes are listed as ranges, such as "0-1,3".  The file is
+     * read without stdio, which would allocate.
+     */
+    nodes = 1;
+    if ((fd = open("/sys/devices/system/node/online", O_RDONLY)) >= 0) {
+	if ((len = read(fd, buf, sizeof(buf) - 1)) > 0) {
+	    buf[len] = '\0';
+	    for (p = buf; ; p = end + 1) {
+		n = strtol(p, &end, 10);
+		if (end == p)
+		    break;
+		if (n >= nodes)
+		    nodes = (int)n + 1;
+		if (*end != '-' && *end != ',')
+		    break;
+	    }
+	}
+	close(fd);
+    }
+    if (nodes > MEM_MAX_NODES)
+	nodes = MEM_MAX_NODES;
+    __atomic_store_n(&mem_nodes, nodes, __ATOMIC_RELAXED);
+    return nodes;
+}
+
+/*
+ * mem_node_self - return the NUMA node that the calling thread is running
+ *    on, or 0 if it cannot be found
+ */
+int mem_node_self(void)
+{
+    unsigned cpu, node = 0;
+
+#ifdef SYS_getcpu
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+	return 0;
+#endif
+    (void)cpu;
+    return (int)node < mem_node_count() ? (int)node : 0;
+}
+
+/*
+ * mem_arena_bind - prefer NUMA node "node" for the pages of arena "arena",
+ *    moving the pages it already has, or unbind the arena if "node" is -1.
+ *    Returns 0 on success and -1 if the system does not support binding.
+ */
+int mem_arena_bind(int arena, int node)
+{
+    arena_t *a;
+#ifdef SYS_mbind
+    unsigned long mask;
+#endif
+
+    assert(arena >= 0 && arena < MAX_ARENAS);
+    a = &mem_arenas[arena];
+    if (node < -1 || node >= mem_node_count())
+	return -1;
+#ifdef SYS_mbind
+    mask = node < 0 ? 0 : 1UL << node;
+    if (syscall(SYS_mbind, a->start_brk, (size_t)MEM_ARENA_SIZE, 
+		node < 0 ? MPOL_DEFAULT : MPOL_PREFERRED, node < 0 ? NULL : &mask,
+		node < 0 ? 0UL : (unsigned long)MEM_MAX_NODES + 1, 
+		node < 0 ? 0 : MPOL_MF_MOVE) != 0)
+	return -1;
+#else
+    return -1;
+#endif
+    a->node = node;
+    return 0;
+}
+
+/*
+ * mem_arena_node - return the NUMA node that arena "arena" is bound to, or
+ *    -1 if it is not bound
+ */
+int mem_arena_node(int arena)
+{
+    return mem_arenas[arena].node;
+}
+
+/*
+ * mem_node_usage - set bytes[n], for each of the mem_node_count() NUMA
+ *    nodes n, to the number of bytes of the heaps and regions that are
+ *    resident on node n
+ */
+void mem_node_usage(size_t *bytes)
+{
+    region_t *r;
+    size_t b;
+    int i;
+
+    memset(bytes, 0, (size_t)mem_node_count() * sizeof(size_t));
+    for (i = 0; i < MAX_ARENAS; i++)
+	mem_node_tally(mem_arenas[i].start_brk, 
+		       (size_t)(mem_arenas[i].brk - mem_arenas[i].start_brk),
+		       bytes);
+    for (b = 0; b < mem_nbuckets; b++)
+	for (r = mem_buckets[b]; r != NULL; r = r->next)
+	    mem_node_tally(r->start, r->size, bytes);
+}
+
+/*
+ * mem_region_new - return an unused region_t, carving a page of them when
+ *    there are none.  Their pages are never given back.
+ */
+static region_t *mem_region_new(void)
+{
+    size_t pagesize = mem_pagesize();
+    region_t *r, *page;
+    size_t i;
+
+    if (mem_spare_regions == NULL) {
+	page = mmap(NULL, pagesize, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED)
+	    return NULL;
+	for (i = 0; i < pagesize / sizeof(region_t); i++) {
+	    page[i].next = mem_spare_regions;
+	    mem_spare_regions = &page[i];
+	}
+    }
+    r = mem_spare_regions;
+    mem_spare_regions = r->next;
+    return r;
+}
+
+/*
+ * mem_bucket - return the bucket of the region that starts at start
+ */
+static region_t **mem_bucket(const void *start)
+{
+    uint64_t page = (uintptr_t)start / mem_pagesize();
+
+    return &mem_buckets[(page * MEM_HASH_MULT) >> mem_bucket_shift];
+}
+
+/*
+ * mem_grow_buckets - double the buckets, or make a page of them if there
+ *    are none, and move the regions into them.  Returns -1, leaving the
+ *    table as it was, if there is no memory for the new buckets.
+ */
+static int mem_grow_buckets(void)
+{
+    region_t **old = mem_buckets, **rp, *r;
+    size_t oldn = mem_nbuckets, n, b;
+    void *table;
+
+    n = (oldn > 0) ? 2 * oldn : mem_pagesize() / sizeof(region_t *);
+    table = mmap(NULL, n * sizeof(region_t *), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED)
+	return -1;
+    mem_buckets = table;
+    mem_nbuckets = n;
+    for (mem_bucket_shift = 64; n > 1; n /= 2)
+	mem_bucket_shift--;
+
+    for (b = 0; b < oldn; b++) {
+	while ((r = old[b]) != NULL) {
+	    old[b] = r->next;
+	    rp = mem_bucket(r->start);
+	    r->next = *rp;
+	    *rp = r;
+	}
+    }
+    if (old != NULL)
+	munmap(old, oldn * sizeof(region_t *));
+    return 0;
+}
+
+/*
+ * mem_add_footprint - add incr bytes to the footprint, and raise its peak
+ *    to match.  Heaps in different arenas grow concurrently.
+ */
+static void mem_add_footprint(intptr_t incr)
+{
+    size_t now, peak;
+
+    now = __atomic_add_fetch(&mem_footprint_now, (size_t)incr, 
+			     __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&mem_footprint_peak, __ATOMIC_RELAXED);
+    while (now > peak && 
+	   !__atomic_compare_exchange_n(&mem_footprint_peak, &peak, now, 1,
+				       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+/*
+ * mem_node_tally - add the resident pages among the size bytes at lo to
+ *    the counts in bytes, by NUMA node.  Without a way to ask, every page
+ *    counts as resident on node 0.
+ */
+static void mem_node_tally(char *lo, size_t size, size_t *bytes)
+{
+    size_t pagesize = mem_pagesize();
+    char *p = lo, *hi = lo + size;
+#ifdef SYS_move_pages
+    void *pages[MEM_NODE_BATCH];
+    int status[MEM_NODE_BATCH];
+    int i, n, nodes = mem_node_count();
+
+    while (p < hi) {
+	for (n = 0; n < MEM_NODE_BATCH && p < hi; n++, p += pagesize)
+	    pages[n] = p;
+	if (syscall(SYS_move_pages, 0, (unsigned long)n, pages, NULL, status,
+		    0) != 0) {
+	    bytes[0] += (size_t)n * pagesize;
+	    continue;
+	}
+	for (i = 0; i < n; i++) {
+	    if (status[i] >= 0 && status[i] < nodes)
+		bytes[status[i]] += pagesize;
+	}
+    }
+#else
+    (void)p;
+    bytes[0] += (size_t)(hi - lo + pagesize - 1) / pagesize * pagesize;
+#endif
+}
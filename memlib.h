@@ -6,3 +6,30 @@ void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+
+/* Independent heaps, each with its own brk; arena 0 is the heap above */
+int mem_arena_count(void);
+size_t mem_arena_maxsize(void);
+int mem_arena_of(const void *p);
+void *mem_arena_sbrk(int arena, intptr_t incr);
+void *mem_arena_lo(int arena);
+void *mem_arena_hi(int arena);
+size_t mem_arena_heapsize(int arena);
+void *mem_arena_fresh(int arena);
+
+/* Regions for blocks too large for a heap, mapped outside the arenas */
+void *mem_map(size_t size);
+void mem_unmap(void *start);
+int mem_mapped(const void *lo, const void *hi);
+size_t mem_mapsize(void);
+
+/* Bytes held by all heaps and regions, now and at most since reset */
+size_t mem_footprint(void);
+size_t mem_peak_footprint(void);
+
+/* NUMA placement of the arenas, and the resident bytes on each node */
+int mem_node_count(void);
+int mem_node_self(void);
+int mem_arena_bind(int arena, int node);
+int mem_arena_node(int arena);
+void mem_node_usage(size_t *bytes);
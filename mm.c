@@ -1,23 +1,50 @@
 /* 
- * Simple, 32-bit and 64-bit clean allocator based on an implicit free list,
- * first fit placement, and boundary tag coalescing, as described in the
- * CS:APP3e text.  Blocks are aligned to double-word boundaries.  This
- * yields 8-byte aligned blocks on a 32-bit processor, and 16-byte aligned
- * blocks on a 64-bit processor.  However, 16-byte alignment is stricter
- * than necessary; the assignment only requires 8-byte alignment.  The
- * minimum block size is four words.
+ * Simple, 32-bit and 64-bit clean allocator based on segregated free lists
+ * and boundary tag coalescing, extended from the one in the CS:APP3e text.
+ * Free blocks are kept in a two-level table of size classes, as in TLSF,
+ * with a bitmap per level, so that the first nonempty class that fits is
+ * found in constant time.  Free blocks of at least TREE_MIN bytes are kept
+ * in a red-black tree instead.  Within a class, placement is first fit,
+ * best of a few fits, or address-ordered best fit, as set by MM_FIT_POLICY.
+ * Only free blocks have a footer; each header records whether the block
+ * before it is allocated.  Small requests are served from slab runs of
+ * same-sized objects, and, while MM_DEFER_COALESCE is set, freed blocks
+ * may wait in quick bins before being coalesced.  Requests of at least
+ * MM_MMAP_THRESHOLD bytes get a mapping of their own from mem_map, and a
+ * heap is trimmed once its free tail exceeds MM_TRIM_THRESHOLD.  Blocks
+ * are aligned to ALIGN_SIZE bytes, 8 by default.  The heap can be checked
+ * incrementally, a few blocks per call.
+ *
+ * Built with MM_THREADS, the allocator is thread safe: each thread
+ * allocates from one of several heaps, each in its own memlib arena, keeps
+ * a cache of small blocks in front of it, and frees blocks of other heaps
+ * onto those heaps' lock-free remote stacks.
  *
  * This allocator uses the size of a pointer, e.g., sizeof(void *), to
  * define the size of a word.  This allocator also uses the standard
  * type uintptr_t to define unsigned integers that are the same size
- * as a pointer, i.e., sizeof(uintptr_t) == sizeof(void *).
+ * as a pointer, i.e., sizeof(uintptr_t) == sizeof(void *).  Built with
+ * MM_COMPACT, it instead uses 32-bit words, and free list links that are
+ * 32-bit offsets rather than pointers.  Built with MM_HARDEN, it checks
+ * every block that is freed and every free list link that it follows.
+ * Built with one of the MM_PROFILE_* macros, it uses a different set of
+ * the tunable constants below.
  */
 
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
+#ifdef MM_HARDEN
+#include <sys/random.h>
+#include <time.h>
+#endif
+
+#include "config.h"
 #include "memlib.h"
 #include "mm.h"
 
@@ -38,34 +65,232 @@ team_t team = {
 	"qg8"
 };
 
-/* Basic constants and macros: */
-#define WSIZE      sizeof(void *) /* Word and header/footer size (bytes) */
+/*
+ * Basic constants and macros.  The compact build, MM_COMPACT, uses 32-bit
+ * words for headers, footers and free list links, which requires every heap
+ * to lie within 4 GB of the first, but halves the minimum block size on a
+ * 64-bit processor.
+ */
+#ifdef MM_COMPACT
+typedef uint32_t word_t;
+#else
+typedef uintptr_t word_t;
+#endif
+#if defined(MM_HARDEN) && (defined(MM_COMPACT) || UINTPTR_MAX != UINT64_MAX)
+#error "MM_HARDEN needs 64-bit words to hold its canaries"
+#endif
+#define WSIZE      sizeof(word_t) /* Word and header/footer size (bytes) */
 #define DSIZE      (2 * WSIZE)    /* Doubleword size (bytes) */
-#define ALIGN_SIZE 8		  /* Alignment size */
-#define SEGSIZE    10             /* Free list segregation */
-#define CHUNKSIZE  (1 << 12)      /* Extend heap by this amount (bytes) */
+
+/*
+ * Configuration profiles.  A profile fixes the alignment, the size class
+ * table, the heap's growth and the rounding of requests at compile time,
+ * so that a build specialized for a kind of workload pays nothing at run
+ * time for the choice.  The default profile is the one that the traces
+ * were tuned with.  MM_PROFILE_DENSE favors utilization: coarser size
+ * classes, so that a fit is chosen among more blocks, less rounding of
+ * small requests, and less slack for blocks that realloc moves.
+ * MM_PROFILE_FAST favors throughput: a heap that grows by an eighth of
+ * itself at a time, so that it is extended fewer times.  MM_PROFILE_ALIGN16
+ * aligns every block to 16 bytes, as the C library's malloc does on
+ * 64-bit machines.  Any of the constants can also be set alone with -D.
+ */
+#if defined(MM_PROFILE_DENSE)
+#define SL_LOG2    2
+#define ROUND_MAX  (4 * DSIZE)
+#define REALLOC_GROWTH 150
+#elif defined(MM_PROFILE_FAST)
+#define CHUNKSIZE  (1 << 14)
+#define CHUNK_SHIFT 3
+#elif defined(MM_PROFILE_ALIGN16)
+#define ALIGN_LOG2 4
+#endif
+
+#ifndef ALIGN_LOG2
+#define ALIGN_LOG2 3                /* Log2 of the alignment size */
+#endif
+#ifndef CHUNKSIZE
+#define CHUNKSIZE  (1 << 12)        /* Extend heap by at least this (bytes) */
+#endif
+#ifndef CHUNK_SHIFT
+#define CHUNK_SHIFT 0               /* If set, by 1/2^CHUNK_SHIFT of it */
+#endif
+#ifndef CHUNK_MAX
+#define CHUNK_MAX  (1 << 20)        /* Most that the heap grows by at once */
+#endif
+#ifndef ROUND_MAX
+#define ROUND_MAX  (16 * DSIZE)     /* Round requests of at most this up to
+				       a power of two (bytes) */
+#endif
+#ifndef REALLOC_GROWTH
+#define REALLOC_GROWTH 200          /* Default MM_REALLOC_GROWTH (percent) */
+#endif
+#define ALIGN_SIZE (1 << ALIGN_LOG2) /* Alignment size */
+_Static_assert(ALIGN_SIZE >= 8 && ALIGN_SIZE <= DSIZE,
+    "ALIGN_SIZE must be from 8 bytes to a doubleword");
+#define FIT_PROBES 8              /* Default MM_FIT_PROBES */
+#define MMAP_THRESHOLD (128 * 1024) /* Default MM_MMAP_THRESHOLD (bytes) */
+#define TRIM_THRESHOLD (128 * 1024) /* Default MM_TRIM_THRESHOLD (bytes) */
+
+/*
+ * Free list segregation.  Size classes form a two-level table: the first
+ * level splits sizes by power of two and the second level splits each power
+ * of two into SL_COUNT equal ranges.  Sizes below 2^FL_SHIFT share first
+ * level 0, which is split linearly in ALIGN_SIZE steps.
+ */
+#ifndef SL_LOG2
+#define SL_LOG2    3                      /* Log2 of second-level count */
+#endif
+#define SL_COUNT   (1 << SL_LOG2)         /* Classes per first level */
+#define FL_SHIFT   (SL_LOG2 + ALIGN_LOG2) /* log2(SL_COUNT * ALIGN_SIZE) */
+#define FL_COUNT   24                     /* Number of first levels */
+#define SEGSIZE    (FL_COUNT * SL_COUNT)  /* Number of size classes */
+#if SL_LOG2 < 1 || SL_LOG2 > 4
+#error "SL_LOG2 must be from 1 to 4"
+#endif
+
+/*
+ * Free blocks of at least TREE_MIN bytes are not kept in the size classes
+ * but in a red-black tree ordered by size and then address, so that the
+ * best fit among them is found in logarithmic time.  TREE_MIN must be a
+ * power of two of at least 2^FL_SHIFT, so that the classes it replaces are
+ * whole first levels.
+ */
+#define TREE_MIN   (1 << 12)              /* Smallest block in the tree */
+#if TREE_MIN < (1 << FL_SHIFT)
+#error "TREE_MIN must be at least 2^FL_SHIFT"
+#endif
+
+/*
+ * Slab allocation.  Requests of at most SLAB_MAX bytes are served from runs:
+ * RUN_SIZE-aligned, RUN_SIZE-byte blocks of the heap that are split into
+ * objects of one size class, with no per-object header or footer.  Classes
+ * are ALIGN_SIZE bytes apart.  So that a few stray small requests do not
+ * each pin down a mostly empty run, a class only gets runs once it has seen
+ * SLAB_WARMUP requests; until then they take the boundary-tag path.  Runs
+ * are kept small, and a run goes back to the heap as soon as it is empty,
+ * so that a class pins down little more than its live objects.  Each arena
+ * has a static map with a bit per RUN_SIZE page, set if the page is a run,
+ * so that the map takes nothing from the heap.
+ */
+#define SLAB_MAX     (16 * DSIZE)             /* Largest slab object */
+#define SLAB_CLASSES ((int)(SLAB_MAX / ALIGN_SIZE)) /* Number of classes */
+#define RUN_SIZE     (1 << 10)                /* Size of a run (bytes) */
+#define SLAB_MAP_BYTES ((size_t)MEM_ARENA_SIZE / RUN_SIZE / 8) /* Per arena */
+#define SLAB_WARMUP  16   /* Requests per class before its first run */
+#define ALIGN_PROBES 32       /* Free blocks tried for an aligned fit */
+
+/*
+ * Deferred coalescing.  While MM_DEFER_COALESCE is set, freed blocks of at
+ * most QUICK_MAX bytes are not coalesced but kept in quick bins, by exact
+ * size, for reuse by the next request of that size.  Binned blocks still
+ * look allocated to their neighbors.  The bins are coalesced all at once
+ * when a fit fails or they hold more than QUICK_BUDGET bytes.  An arena's
+ * table of bins is static, so that freeing a block never has to allocate.
+ */
+#define QUICK_MAX    (1 << 10)              /* Largest binned block */
+#define QUICK_BINS   ((int)((QUICK_MAX - 2 * DSIZE) / ALIGN_SIZE) + 1)
+#define QUICK_BUDGET (1 << 16)              /* Most bytes held in bins */
+
+/* Given block size, compute its quick bin. */
+#define QUICK_BIN(size)  (((size) - 2 * DSIZE) / ALIGN_SIZE)
+
+/*
+ * Heap consistency checking.  The checker walks a heap block by block, and
+ * its size classes and tree free block by free block, taking up to
+ * CHECK_BUDGET of each per step and resuming where the last step stopped.
+ * Every check is constant time, so a step costs the same however large the
+ * heap is.  While MM_CHECK_INTERVAL is set, a step is taken every that many
+ * calls that reach a heap.  A walk whose next block is merged into another,
+ * or trimmed away, or whose next free block is allocated, starts over.
+ */
+#define CHECK_BUDGET 32  /* Blocks and free blocks checked per step */
+
+/*
+ * Regions.  A region bump-allocates objects from chunks that it takes from
+ * mm_malloc, and frees them all at once when it is destroyed.  Objects of
+ * more than REGION_LARGE bytes get a chunk of their own.
+ */
+#define REGION_CHUNK ((1 << 16) - WSIZE)    /* Chunk size, a 64 KB block */
+#define REGION_LARGE (REGION_CHUNK / 4)     /* Largest object in a chunk */
+
+/* The size of a chunk's header, rounded up to keep objects aligned. */
+#define REGION_HDR   (ALIGN_SIZE * ((sizeof(struct region_chunk) + \
+    ALIGN_SIZE - 1) / ALIGN_SIZE))
 
 #define MAX(x, y)  ((x) > (y) ? (x) : (y))  
+#define MIN(x, y)  ((x) < (y) ? (x) : (y))  
 
-/* Pack a size and allocated bit into a word. */
+/*
+ * Pack a size and allocated bits into a word.  Only free blocks have a
+ * footer, so each header also records whether the block before it is
+ * allocated.
+ */
 #define PACK(size, alloc)  ((size) | (alloc))
+#define PREV_ALLOC         0x2
+
+/*
+ * Hardened build.  The upper half of an allocated block's header holds a
+ * canary, a keyed hash of the block's address, which mm_free and mm_realloc
+ * check.  Free list links are stored XORed with the same key, and every
+ * link is checked to point into the heaps as it is followed.  The key is
+ * drawn anew by each mm_init.  Either check aborts on failure.
+ */
+#ifdef MM_HARDEN
+#define SIZE_MASK   ((word_t)UINT32_MAX & ~(word_t)(ALIGN_SIZE - 1))
+#define CANARY(bp)  ((((uintptr_t)(bp) ^ harden_key) * \
+    (uintptr_t)0x9e3779b97f4a7c15) & ~(uintptr_t)UINT32_MAX)
+#else
+#define SIZE_MASK   (~(word_t)(ALIGN_SIZE - 1))
+#define CANARY(bp)  0
+#endif
 
 /* Read and write a word at address p. */
-#define GET(p)       (*(uintptr_t *)(p))
-#define PUT(p, val)  (*(uintptr_t *)(p) = (val))
+#define GET(p)       (*(word_t *)(p))
+#define PUT(p, val)  (*(word_t *)(p) = (val))
 
 /* Read the size and allocated fields from address p. */
-#define GET_SIZE(p)   (GET(p) & ~(ALIGN_SIZE - 1))
+#define GET_SIZE(p)   ((size_t)(GET(p) & SIZE_MASK))
 #define GET_ALLOC(p)  (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p)  (GET(p) & PREV_ALLOC)
 
-/* Given block ptr bp, compute address of its header and footer. */
+/* Set or clear the prev-alloc bit of the header at address p. */
+#define SET_PREV_ALLOC(p)  PUT(p, GET(p) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(p)  PUT(p, GET(p) & ~(word_t)PREV_ALLOC)
+
+/* Given block ptr bp, compute address of its header and free footer. */
 #define HDRP(bp)  ((char *)(bp) - WSIZE)
 #define FTRP(bp)  ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
-/* Given block ptr bp, compute address of next and previous blocks. */
+/*
+ * Given block ptr bp, compute address of next and previous blocks.  The
+ * previous block can only be found if it is free.
+ */
 #define NEXT_BLKP(bp)  ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
 #define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
+#ifdef MM_COMPACT
+/*
+ * Struct for segregated free list.  The links are offsets from "link_base",
+ * the start of the first heap, and 0 stands for NULL.
+ */
+struct block_list
+{
+	uint32_t next_off; /* Offset of next block list */
+	uint32_t prev_off; /* Offset of previous block list */
+};
+
+#define LIST_OFF(bp)  ((bp) == NULL ? 0 : \
+    (uint32_t)((char *)(bp) - link_base))
+#define LIST_AT(off)  ((off) == 0 ? NULL : \
+    (struct block_list *)(link_base + (off)))
+
+/* Read and write the links of block list bp. */
+#define NEXT_LIST(bp)          LIST_AT((bp)->next_off)
+#define PREV_LIST(bp)          LIST_AT((bp)->prev_off)
+#define SET_NEXT_LIST(bp, np)  ((bp)->next_off = LIST_OFF(np))
+#define SET_PREV_LIST(bp, np)  ((bp)->prev_off = LIST_OFF(np))
+#else
 /* Struct for segregated free list. */
 struct block_list
 {
@@ -73,28 +298,352 @@ struct block_list
 	struct block_list *prev_list; /* Pointer to previous block list */
 };
 
+/* Read and write the links of block list bp. */
+#ifdef MM_HARDEN
+#define LINK_CODE(np)  ((struct block_list *)((uintptr_t)(np) ^ harden_key))
+#define NEXT_LIST(bp)          link_decode((bp)->next_list)
+#define PREV_LIST(bp)          link_decode((bp)->prev_list)
+#define SET_NEXT_LIST(bp, np)  ((bp)->next_list = LINK_CODE(np))
+#define SET_PREV_LIST(bp, np)  ((bp)->prev_list = LINK_CODE(np))
+#else
+#define NEXT_LIST(bp)          ((bp)->next_list)
+#define PREV_LIST(bp)          ((bp)->prev_list)
+#define SET_NEXT_LIST(bp, np)  ((bp)->next_list = (np))
+#define SET_PREV_LIST(bp, np)  ((bp)->prev_list = (np))
+#endif
+#endif
+
+/*
+ * Struct for the header of a slab run, stored at the start of the run.  The
+ * objects follow it.  Objects that have never been allocated lie at and
+ * above "bump"; freed objects are linked through their first word.
+ */
+struct slab_run
+{
+	struct slab_run *next_run; /* Next partial run of the same class */
+	struct slab_run *prev_run; /* Previous partial run of the same class */
+	void *free_objs;           /* First freed object */
+	char *bump;                /* First never-allocated object */
+	uint32_t size;             /* Object size (bytes) */
+	uint32_t nfree;            /* Number of free objects */
+	uint32_t nobjs;            /* Number of objects */
+};
+
+/*
+ * Struct for a node of the tree of large free blocks, stored in the payload
+ * like a "struct block_list".
+ */
+struct tree_node
+{
+	struct tree_node *child[2]; /* Smaller and larger blocks */
+	struct tree_node *parent;   /* Parent node, or NULL at the root */
+	uintptr_t red;              /* Is the node red? */
+};
+
+/* Given slab class, compute its object size, and vice versa. */
+#define SLAB_SIZE(index)  (((index) + 1) * ALIGN_SIZE)
+#define SLAB_INDEX(size)  (((size) + ALIGN_SIZE - 1) / ALIGN_SIZE - 1)
+
+/* Given a run, compute the address of its first object. */
+#define RUN_OBJS(run)  ((char *)(run) + ALIGN_SIZE * \
+    ((sizeof(struct slab_run) + ALIGN_SIZE - 1) / ALIGN_SIZE))
+
+/*
+ * Struct for the size class table.  Bit "fl" of "fl_bitmap" is set if any
+ * class on first level "fl" is nonempty, and bit "sl" of "sl_bitmap[fl]" is
+ * set if class "fl * SL_COUNT + sl" is nonempty.
+ */
+struct seg_table
+{
+	uint32_t fl_bitmap;                    /* Nonempty first levels */
+	uint32_t sl_bitmap[FL_COUNT];          /* Nonempty classes per level */
+	struct block_list *seg_first[SEGSIZE]; /* First free block per class */
+	struct tree_node *tree_root;           /* Blocks of TREE_MIN or more */
+};
+
+#ifdef MM_THREADS
+#define MM_ARENAS  8  /* Most memlib arenas used for heaps */
+#else
+#define MM_ARENAS  1
+#endif
+
+/*
+ * Struct for an arena: an independent heap, with its own size class table,
+ * in one memlib arena.  The struct itself is stored at the start of that
+ * heap.
+ */
+struct mm_arena
+{
+	struct seg_table segs; /* Size class table */
+	char *heap_listp;      /* Pointer to first block */
+	char *heap_lo;         /* First byte of the memlib arena */
+	uint8_t *slab_map;     /* Bit per RUN_SIZE page, set if it is a run */
+	struct slab_run *slab_partial[SLAB_CLASSES]; /* Runs with free objects */
+	unsigned int slab_demand[SLAB_CLASSES];      /* Requests, to warmup */
+	struct block_list **quick;                   /* Blocks to coalesce */
+	size_t quick_bytes;    /* Bytes held in "quick" */
+	int id;                /* Index of the memlib arena */
+	char *check_bp;        /* Next block the checker visits, or NULL */
+	struct block_list *check_fp; /* Next free block it visits, or NULL */
+	int check_index;       /* Size class of "check_fp", SEGSIZE for the tree */
+	unsigned int check_calls; /* Calls since the checker's last step */
+	unsigned long stat_splits;     /* Free blocks split by placement */
+	unsigned long stat_coalesces;  /* Free neighbors merged */
+	unsigned long stat_fits;       /* Calls to find_fit */
+	unsigned long stat_probes;     /* Free blocks they examined */
+	unsigned long stat_rounded;    /* Requests rounded to a power of 2 */
+	unsigned long stat_round_bytes; /* Bytes added by that rounding */
+#ifdef MM_THREADS
+	pthread_mutex_t lock;  /* Guards the heap and "segs" */
+	struct block_list *remote __attribute__((aligned(64))); /* See below */
+#endif
+};
+
+/* Struct for the header of a region's chunk. */
+struct region_chunk
+{
+	struct region_chunk *next; /* Next older chunk of the region */
+};
+
+/* Struct for a region. */
+struct mm_region
+{
+	struct region_chunk *chunks; /* Chunks, the one being filled first */
+	char *bump;                  /* Next free byte of that chunk */
+	char *limit;                 /* End of that chunk */
+};
+
 /* Global variables: */
-static char *heap_listp; /* Pointer to first block. */  
+static struct mm_arena *arenas[MM_ARENAS]; /* Initialized arenas, or NULL */
+static struct block_list *quick_tables[MM_ARENAS][QUICK_BINS]; /* Bins */
+static uint8_t slab_maps[MM_ARENAS][SLAB_MAP_BYTES];  /* Run maps */
+#ifdef MM_COMPACT
+static char *link_base;                    /* Base of free list offsets */
+#endif
+#ifdef MM_HARDEN
+static uintptr_t harden_key;               /* Secret of links and canaries */
+static char *link_lo, *link_hi;            /* Bounds of every heap */
+#endif
+
+/* Tunable parameters, set by mm_mallopt: */
+static int realloc_growth = REALLOC_GROWTH; /* See MM_REALLOC_GROWTH */
+static int fit_request = MM_FIT_FIRST;      /* See MM_FIT_POLICY */
+static int fit_probes = FIT_PROBES;         /* See MM_FIT_PROBES */
+static size_t mmap_threshold = MMAP_THRESHOLD; /* See MM_MMAP_THRESHOLD */
+static size_t trim_threshold = TRIM_THRESHOLD; /* See MM_TRIM_THRESHOLD */
+static bool defer_coalesce = false;         /* See MM_DEFER_COALESCE */
+static bool numa_request = false;           /* See MM_NUMA */
+static unsigned int check_interval = 0;     /* See MM_CHECK_INTERVAL */
+
+/*
+ * The placement policy in use.  Address-ordered lists must be built that way
+ * from the start, so a new policy only takes effect at mm_init.
+ */
+static int fit_policy = MM_FIT_FIRST;
+
+/* Whether the arenas are bound to NUMA nodes, also fixed at mm_init. */
+static bool numa_arenas = false;
+
+#ifdef MM_THREADS
+/*
+ * Thread-safe build.  Each thread is assigned an arena round-robin on its
+ * first call, and allocates from that arena under the arena's lock.  Arenas
+ * other than arena 0 are initialized on first use.  In front of the arenas,
+ * each thread keeps a cache of small blocks, binned by exact block size,
+ * that it can reuse without taking any lock.  Cached blocks still look
+ * allocated to their heap, so they cannot be coalesced.  So that they do
+ * not inflate the heap, a bin holds at most TCACHE_BIN_BYTES worth of
+ * blocks, and at most TCACHE_CAP of them, a cache holds at most
+ * TCACHE_BUDGET bytes in all, and a thread returns its cache to its heap
+ * before extending that heap.  Bins are refilled from and flushed to the
+ * heap up to TCACHE_FILL blocks at a time, and only the first block of a
+ * refill may extend the heap.  A block freed by a thread other than one
+ * assigned to its arena is pushed onto the arena's "remote" stack with a
+ * CAS, on a cache line of its own, instead of taking the arena's lock.  The
+ * arena's own threads drain that stack whenever they allocate from the
+ * heap.  Once an arena's last thread has exited, the exiting thread drains
+ * its stack, and so does every later remote free until a new thread is
+ * assigned to the arena.  mm_init must not run concurrently with any other
+ * call.
+ */
+#define TCACHE_MAX  (1 << 10)   /* Largest block size held in a cache */
+#define TCACHE_BINS (SLAB_CLASSES + (int)((TCACHE_MAX - 2 * DSIZE) / \
+    ALIGN_SIZE) + 1)
+#define TCACHE_FILL 8           /* Most blocks moved per refill or flush */
+#define TCACHE_CAP  (4 * TCACHE_FILL) /* Most blocks held per bin */
+#define TCACHE_BIN_BYTES (1 << 11) /* Bytes per bin, to scale its cap */
+#define TCACHE_BUDGET (1 << 14) /* Most bytes held in a cache */
+
+/* Struct for a per-thread cache. */
+struct tcache
+{
+	unsigned long gen;                    /* Heap generation of the bins */
+	unsigned long rounded;                /* Rounding counts not yet */
+	unsigned long round_bytes;            /* added to the arena's */
+	size_t bytes;                         /* Bytes held in all bins */
+	size_t freed;                         /* Bytes freed in since return */
+	unsigned int count[TCACHE_BINS];      /* Number of blocks per bin */
+	struct block_list *bins[TCACHE_BINS]; /* Cached blocks, via next_list */
+};
 
-/* Pointer to first free block. */
-struct block_list *seg_first; 
+static pthread_mutex_t arena_init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER; /* mem_map */
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;   /* Flushes a thread's cache at exit */
+static unsigned long heap_gen;     /* Incremented by every mm_init */
+static int arena_next;             /* Next arena to assign to a thread */
+static int arena_threads[MM_ARENAS]; /* Live threads assigned to each */
+static __thread int arena_slot;    /* 1 + this thread's arena, or 0 */
+static __thread struct tcache tcache;
+
+#define HEAP_LOCK(ar)    pthread_mutex_lock(&(ar)->lock)
+#define HEAP_UNLOCK(ar)  pthread_mutex_unlock(&(ar)->lock)
+#define MAP_LOCK()       pthread_mutex_lock(&map_lock)
+#define MAP_UNLOCK()     pthread_mutex_unlock(&map_lock)
+#define REMOTE_DRAIN(ar) remote_drain(ar)
+
+/*
+ * Given slab object size or block size, compute its thread cache bin.  The
+ * first SLAB_CLASSES bins hold slab objects.
+ */
+#define TCACHE_SLAB_BIN(size)  SLAB_INDEX(size)
+#define TCACHE_BIN(size)  (SLAB_CLASSES + ((size) - 2 * DSIZE) / ALIGN_SIZE)
+
+/* Given thread cache bin, compute the size of its blocks or objects. */
+#define TCACHE_SIZE(bin)  ((bin) < SLAB_CLASSES ? (size_t)SLAB_SIZE(bin) : \
+    ((bin) - SLAB_CLASSES) * ALIGN_SIZE + 2 * DSIZE)
+
+/*
+ * Given thread cache bin, compute the most blocks it holds, which is fewer
+ * for larger blocks, and the number moved per refill or flush.
+ */
+#define TCACHE_BIN_CAP(bin)  MAX(1, MIN(TCACHE_CAP, \
+    (int)(TCACHE_BIN_BYTES / TCACHE_SIZE(bin))))
+#define TCACHE_BIN_FILL(bin) MAX(1, MIN(TCACHE_FILL, TCACHE_BIN_CAP(bin) / 4))
+#define TCACHE_RETURN(ar) tcache_return(ar)
+#else
+#define HEAP_LOCK(ar)
+#define HEAP_UNLOCK(ar)
+#define MAP_LOCK()
+#define MAP_UNLOCK()
+#define REMOTE_DRAIN(ar)
+#define TCACHE_RETURN(ar) false
+#endif
+
+/* Take a checker step on "ar" once every "check_interval" calls. */
+#define CHECK_SAMPLE(ar)  do {						\
+	if (check_interval != 0 && ++(ar)->check_calls >= check_interval) { \
+		(ar)->check_calls = 0;					\
+		checkheap((ar), CHECK_BUDGET, false);			\
+	}								\
+} while (0)
+
+/* Restart the checker's heap walk if its next block was merged into "bp". */
+#define CHECK_FORGET(ar, bp)  do {					\
+	if ((ar)->check_bp > (char *)(bp) &&				\
+	    (ar)->check_bp < NEXT_BLKP(bp))				\
+		(ar)->check_bp = NULL;					\
+} while (0)
+
+/*
+ * Count a request of "n" bytes less than the power of two it is rounded up
+ * to.  The thread-safe build counts in the thread's cache, without a lock,
+ * and adds the counts to the arena at the cache's next refill.
+ */
+#ifdef MM_THREADS
+#define STAT_ROUND(ar, n)  do {						\
+	tcache.rounded++;						\
+	tcache.round_bytes += (n);					\
+} while (0)
+#else
+#define STAT_ROUND(ar, n)  do {						\
+	(ar)->stat_rounded++;						\
+	(ar)->stat_round_bytes += (n);					\
+} while (0)
+#endif
 
 /* Function prototypes for internal helper routines: */
-static void *coalesce(void *bp);
-static void *extend_heap(size_t words);
-static void *find_fit(size_t asize);
-static void place(void *bp, size_t asize);
+static struct mm_arena *arena_init(int id);
+static struct mm_arena *arena_of(void *bp);
+static struct mm_arena *arena_self(void);
+static int arena_node(int id);
+static void *coalesce(struct mm_arena *ar, void *bp);
+static void *extend_heap(struct mm_arena *ar, size_t words);
+static size_t chunk_size(struct mm_arena *ar);
+static void *find_fit(struct mm_arena *ar, size_t asize);
+static void *heap_malloc(struct mm_arena *ar, size_t asize);
+static void *heap_malloc_aligned(struct mm_arena *ar, size_t align,
+    size_t asize);
+static void heap_free(struct mm_arena *ar, void *bp);
+static void heap_free_now(struct mm_arena *ar, void *bp);
+static bool heap_grow(struct mm_arena *ar, void *bp, size_t asize);
+static void heap_trim(struct mm_arena *ar, void *bp);
+static void place(struct mm_arena *ar, void *bp, size_t asize);
+static void *map_malloc(size_t size);
+static void map_free(void *bp);
+static void quick_flush(struct mm_arena *ar);
+static void zero_block(void *bp, size_t size, void *fresh);
+
+/* Function prototypes for slab routines: */
+static void *slab_malloc(struct mm_arena *ar, size_t size);
+static void slab_free(struct mm_arena *ar, struct slab_run *run, void *bp);
+static struct slab_run *slab_run_of(struct mm_arena *ar, void *bp);
+static bool slab_wanted(struct mm_arena *ar, size_t size);
+
+/* Function prototypes for tree routines: */
+static void tree_insert(struct mm_arena *ar, struct tree_node *np);
+static void tree_remove(struct mm_arena *ar, struct tree_node *np);
+static struct tree_node *tree_find(struct mm_arena *ar, size_t asize);
+static struct tree_node *tree_next(struct tree_node *np);
+static void tree_replace(struct mm_arena *ar, struct tree_node *old,
+    struct tree_node *np);
+static void tree_rotate(struct mm_arena *ar, struct tree_node *np, int dir);
 
 /* Function prototypes for heap consistency checker routines: */
-static void checkblock(void *bp);
-static void checkheap(bool verbose);
-static void printblock(void *bp); 
+static void checkblock(struct mm_arena *ar, void *bp);
+static bool checkfree(struct mm_arena *ar, void *bp, int index);
+static void checkheap(struct mm_arena *ar, unsigned int budget,
+    bool verbose);
+static void checktree(struct mm_arena *ar, struct tree_node *np);
+static void printblock(struct mm_arena *ar, void *bp); 
+#ifdef MM_HARDEN
+static struct block_list *link_decode(struct block_list *link);
+static void harden_check(struct mm_arena *ar, void *bp, const char *op);
+static void harden_fail(const char *what, void *bp);
+#endif
 
 /* Helper functions: */
-static void list_remove(struct block_list *bp);
-static void list_insert(struct block_list *bp, size_t size);
+static void list_remove(struct mm_arena *ar, struct block_list *bp);
+static void list_insert(struct mm_arena *ar, struct block_list *bp,
+    size_t size);
 static int seg_index(size_t size);
+static size_t seg_min_size(int index);
+static void arena_stats(struct mm_arena *ar, struct mm_stats *st);
+static void stats_block(struct mm_stats *st, int index, size_t size);
+static int seg_next_nonempty(struct mm_arena *ar, int index);
 static size_t next_power_of_2(size_t n);
+static size_t aligned_gap(void *bp, size_t align);
+static bool batch_heap_block(struct mm_arena *ar, void *bp);
+static int ptr_compare(const void *a, const void *b);
+
+#ifdef MM_THREADS
+/* Thread cache routines: */
+static struct tcache *tcache_get(void);
+static void *tcache_malloc(struct mm_arena *ar, int bin);
+static void tcache_free(int bin, void *bp);
+static void *tcache_refill(struct tcache *tc, struct mm_arena *ar, int bin);
+static void tcache_flush(struct tcache *tc, int bin, unsigned int n);
+static bool tcache_return(struct mm_arena *ar);
+static void tcache_key_create(void);
+static void tcache_destroy(void *arg);
+static void remote_free(struct mm_arena *ar, void *bp);
+static void remote_drain(struct mm_arena *ar);
+static void fork_register(void);
+static void fork_prepare(void);
+static void fork_release(void);
+static void fork_child(void);
+#endif
 
 /* 
  * Requires:
@@ -107,29 +656,45 @@ static size_t next_power_of_2(size_t n);
 int 
 mm_init(void) 
 {
-	/* Initialize memory for storing the free list in the heap. */
-	if ((seg_first = mem_sbrk(2 * SEGSIZE * sizeof(void*))) == (void *)-1)
-		return (-1);
+	int i;
 
-	/* Initialize seg_first. */
-	int i;	
-	for (i = 0; i < SEGSIZE; i++) {
-		seg_first[i].next_list = &seg_first[i];
-		seg_first[i].prev_list = &seg_first[i];
-	}
+#ifdef MM_THREADS
+	/* Invalidate every thread cache, which still points at the old heap. */
+	__atomic_add_fetch(&heap_gen, 1, __ATOMIC_RELEASE);
 
-	/* Create the initial empty heap. */
-	if ((heap_listp = mem_sbrk(4 * WSIZE)) == (void *)-1)
+	/* Keep every lock consistent across fork(). */
+	pthread_once(&fork_once, fork_register);
+#endif
+
+#ifdef MM_COMPACT
+	/* Every heap must lie within reach of a 32-bit offset. */
+	if ((uint64_t)mem_arena_maxsize() * MIN(MM_ARENAS, mem_arena_count()) >
+	    UINT32_MAX)
 		return (-1);
-	
-	PUT(heap_listp, 0);                            /* Alignment padding */
-	PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1)); /* Prologue header */ 
-	PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */ 
-	PUT(heap_listp + (3 * WSIZE), PACK(0, 1));     /* Epilogue header */
-	heap_listp += 2 * WSIZE;
-	
-	/* Extend the empty heap with a free block of CHUNKSIZE bytes. */
-	if (extend_heap(CHUNKSIZE / WSIZE) == NULL)
+	link_base = mem_heap_lo();
+#endif
+
+#ifdef MM_HARDEN
+	/* Draw a new key, falling back on the clock and the stack address. */
+	if (getrandom(&harden_key, sizeof(harden_key), GRND_NONBLOCK) !=
+	    sizeof(harden_key))
+		harden_key = (uintptr_t)time(NULL) * 0x9e3779b97f4a7c15 ^
+		    (uintptr_t)&i;
+	link_lo = mem_arena_lo(0);
+	link_hi = (char *)mem_arena_lo(mem_arena_count() - 1) +
+	    mem_arena_maxsize();
+#endif
+
+	/* The run maps only cover arenas of up to MEM_ARENA_SIZE bytes. */
+	if (mem_arena_maxsize() > (size_t)MEM_ARENA_SIZE)
+		return (-1);
+
+	/* Forget the old arenas, and start over with arena 0. */
+	fit_policy = fit_request;
+	numa_arenas = numa_request;
+	for (i = 0; i < MM_ARENAS; i++)
+		arenas[i] = NULL;
+	if ((arenas[0] = arena_init(0)) == NULL)
 		return (-1);
 	return (0);
 }
@@ -147,35 +712,58 @@ void *
 mm_malloc(size_t size) 
 {
 	size_t asize;      /* Adjusted block size */
-	size_t extendsize; /* Amount to extend heap if no fit */
+	size_t rsize;      /* Rounded size */
+	struct mm_arena *ar;
 	void *bp;
 
 	/* Ignore spurious requests. */
 	if (size == 0)
 		return (NULL);
+
+	/* Huge requests get a region of their own. */
+	if (size >= mmap_threshold)
+		return (map_malloc(size));
+
+	if ((ar = arena_self()) == NULL)
+		return (NULL);
+
+	/* Small requests are served from slab runs. */
+	if (size <= SLAB_MAX && slab_wanted(ar, size)) {
+#ifdef MM_THREADS
+		return (tcache_malloc(ar, TCACHE_SLAB_BIN(size)));
+#else
+		HEAP_LOCK(ar);
+		bp = slab_malloc(ar, size);
+		CHECK_SAMPLE(ar);
+		HEAP_UNLOCK(ar);
+		return (bp);
+#endif
+	}
 	
 	/* Make sure size is large enough, avoid fragmentation. */
-	if (size <= 16 * DSIZE)
-		size = next_power_of_2(size);
+	if (size <= ROUND_MAX) {
+		rsize = next_power_of_2(size);
+		STAT_ROUND(ar, rsize - size);
+		size = rsize;
+	}
 		
 	/* Adjust block size to include overhead and alignment reqs. */
-	if (size <= DSIZE)
+	if (size <= DSIZE + WSIZE)
 		asize = 2 * DSIZE;
 	else
 		asize = ALIGN_SIZE * 
-		    ((size + DSIZE + (ALIGN_SIZE - 1)) / ALIGN_SIZE);
-
-	/* Search the free list for a fit. */
-	if ((bp = find_fit(asize)) != NULL) {
-		place(bp, asize);
-		return (bp);
-	}
-
-	/* No fit found.  Get more memory and place the block. */
-	extendsize = MAX(asize, CHUNKSIZE);
-	if ((bp = extend_heap(extendsize / WSIZE)) == NULL)  
-		return (NULL);
-	place(bp, asize);
+		    ((size + WSIZE + (ALIGN_SIZE - 1)) / ALIGN_SIZE);
+
+#ifdef MM_THREADS
+	/* Small blocks come from this thread's cache whenever possible. */
+	if (asize <= TCACHE_MAX)
+		return (tcache_malloc(ar, TCACHE_BIN(asize)));
+#endif
+
+	HEAP_LOCK(ar);
+	bp = heap_malloc(ar, asize);
+	CHECK_SAMPLE(ar);
+	HEAP_UNLOCK(ar);
 	return (bp);
 } 
 
@@ -189,17 +777,47 @@ mm_malloc(size_t size)
 void
 mm_free(void *bp)
 {
-	size_t size;
+	struct mm_arena *ar;
+	struct slab_run *run;
 
 	/* Ignore spurious requests. */
 	if (bp == NULL)
 		return;
 
-	/* Free and coalesce the block. */
-	size = GET_SIZE(HDRP(bp));
-	PUT(HDRP(bp), PACK(size, 0));
-	PUT(FTRP(bp), PACK(size, 0));
-	coalesce(bp);
+	ar = arena_of(bp);
+#ifdef MM_HARDEN
+	harden_check(ar, bp, "mm_free");
+#endif
+	if (ar == NULL) {
+		map_free(bp);
+		return;
+	}
+#ifdef MM_THREADS
+	/* Blocks from another thread's arena are handed back to it. */
+	if (arena_slot != ar->id + 1) {
+		remote_free(ar, bp);
+		return;
+	}
+
+	/* Small blocks go to this thread's cache, which flushes when full. */
+	if ((run = slab_run_of(ar, bp)) != NULL) {
+		tcache_free(TCACHE_SLAB_BIN(run->size), bp);
+		return;
+	}
+	size_t size = GET_SIZE(HDRP(bp));
+	if (size <= TCACHE_MAX) {
+		tcache_free(TCACHE_BIN(size), bp);
+		return;
+	}
+#endif
+
+	HEAP_LOCK(ar);
+	if ((run = slab_run_of(ar, bp)) != NULL)
+		slab_free(ar, run, bp);
+	else
+		heap_free(ar, bp);
+	CHECK_SAMPLE(ar);
+	HEAP_UNLOCK(ar);
 }
 
 /*
@@ -218,8 +836,11 @@ mm_free(void *bp)
 void *
 mm_realloc(void *ptr, size_t size)
 {
-	size_t oldsize, asize;
+	size_t oldsize, asize, newsize;
+	struct mm_arena *ar;
+	struct slab_run *run;
 	void *newptr;
+	bool grown;
 
 	/* If size == 0 then this is just free, and we return NULL. */
 	if (size == 0) {
@@ -231,21 +852,52 @@ mm_realloc(void *ptr, size_t size)
 	if (ptr == NULL)
 		return (mm_malloc(size));
 	
-	/* Adjust block size to include overhead and alignment reqs. */
-	if (size <= DSIZE)
-		asize = 2 * DSIZE;
-	else
-		asize = ALIGN_SIZE * 
-		    ((size + DSIZE + (ALIGN_SIZE - 1)) / ALIGN_SIZE);
+	ar = arena_of(ptr);
+#ifdef MM_HARDEN
+	harden_check(ar, ptr, "mm_realloc");
+#endif
+	if (ar == NULL) {
+		/* A huge block can be kept if its region is large enough. */
+		oldsize = GET_SIZE(HDRP(ptr)) - DSIZE;
+		if (size <= oldsize)
+			return (ptr);
+	} else if ((run = slab_run_of(ar, ptr)) != NULL) {
+		/* A slab object can be kept if its class is large enough. */
+		oldsize = run->size;
+		if (size <= oldsize)
+			return (ptr);
+	} else {
+		/* A size this large would wrap the rounding below. */
+		if (size > SIZE_MAX - (WSIZE + ALIGN_SIZE))
+			return (NULL);
+
+		/* Adjust block size to include overhead and alignment reqs. */
+		if (size <= DSIZE + WSIZE)
+			asize = 2 * DSIZE;
+		else
+			asize = ALIGN_SIZE * 
+			    ((size + WSIZE + (ALIGN_SIZE - 1)) / ALIGN_SIZE);
 	
-	/* Copy just the old data, not the old header and footer. */
-	oldsize = GET_SIZE(HDRP(ptr)) - DSIZE;
-	if (asize < oldsize + DSIZE) 
-		return (ptr);
+		/* Copy just the old data, not the old header. */
+		oldsize = GET_SIZE(HDRP(ptr)) - WSIZE;
+		if (asize <= oldsize + WSIZE) 
+			return (ptr);
+
+		/* Try to grow the block where it is. */
+		HEAP_LOCK(ar);
+		grown = heap_grow(ar, ptr, asize);
+		HEAP_UNLOCK(ar);
+		if (grown)
+			return (ptr);
+	}
 	if (size < oldsize)
 		oldsize = size;
 
-	newptr = mm_malloc(SEGSIZE * size);
+	/* Leave room for further growth once the block has to move. */
+	newsize = size;
+	if (size <= SIZE_MAX / (size_t)realloc_growth)
+		newsize = size * realloc_growth / 100;
+	newptr = mm_malloc(newsize);
 
 	/* If realloc() fails, the original block is left untouched.  */
 	if (newptr == NULL)
@@ -260,87 +912,216 @@ mm_realloc(void *ptr, size_t size)
 }
 
 /*
- * The following routines are internal helper routines.
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Allocate a zeroed block for an array of "nmemb" elements of "size"
+ *   bytes each.  Regions and the parts of the heap that have never been
+ *   handed out are already zero, so only the rest of the block is cleared.
+ *   Returns the address of this block if the allocation was successful and
+ *   NULL otherwise.
  */
+void *
+mm_calloc(size_t nmemb, size_t size)
+{
+	size_t asize;      /* Adjusted block size */
+	struct mm_arena *ar;
+	void *bp, *fresh;
+
+	if (nmemb != 0 && size > SIZE_MAX / nmemb)
+		return (NULL);
+	size *= nmemb;
+	if (size == 0)
+		return (NULL);
+	if (size >= mmap_threshold)
+		return (map_malloc(size));
+
+	/* Small blocks are cheaper to clear than to track. */
+	if (size < TREE_MIN) {
+		if ((bp = mm_malloc(size)) != NULL)
+			memset(bp, 0, size);
+		return (bp);
+	}
+	if (size > SIZE_MAX - DSIZE || (ar = arena_self()) == NULL)
+		return (NULL);
+	asize = ALIGN_SIZE * ((size + WSIZE + (ALIGN_SIZE - 1)) / ALIGN_SIZE);
+
+	HEAP_LOCK(ar);
+	fresh = mem_arena_fresh(ar->id);
+	bp = heap_malloc(ar, asize);
+	CHECK_SAMPLE(ar);
+	HEAP_UNLOCK(ar);
+	if (bp != NULL)
+		zero_block(bp, size, fresh);
+	return (bp);
+}
 
 /*
  * Requires:
- *   "bp" is the address of a newly freed block.
+ *   "ptrs" has room for "n" pointers.
  *
  * Effects:
- *   Perform boundary tag coalescing.  Returns the address of the coalesced
- *   block.
+ *   Allocate up to "n" blocks with at least "size" bytes of payload each,
+ *   storing their addresses in "ptrs".  Blocks that are neither slab
+ *   objects nor regions are carved from as few free blocks as possible,
+ *   so that one search serves the whole batch.  Returns the number of
+ *   blocks allocated, which is less than "n" only if memory ran out.
  */
-static void *
-coalesce(void *bp) 
+size_t
+mm_malloc_batch(size_t size, size_t n, void **ptrs)
 {
-	size_t size = GET_SIZE(HDRP(bp));
-	bool prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
-	bool next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+	size_t asize;      /* Adjusted block size */
+	size_t count, csize, done = 0, i, prev;
+	struct mm_arena *ar;
+	char *bp;
+
+	/* Slab objects and regions gain nothing from being carved together. */
+	if (size <= SLAB_MAX || size >= mmap_threshold) {
+		while (done < n && (ptrs[done] = mm_malloc(size)) != NULL)
+			done++;
+		return (done);
+	}
+	if ((ar = arena_self()) == NULL)
+		return (0);
+	asize = ALIGN_SIZE * ((size + WSIZE + (ALIGN_SIZE - 1)) / ALIGN_SIZE);
+
+	HEAP_LOCK(ar);
+	while (done < n) {
+		/* Take one block for the rest, halving it until one fits. */
+		count = MIN(n - done, mem_arena_maxsize() / asize);
+		while (count > 0 && (bp = heap_malloc(ar, count * asize)) == NULL)
+			count /= 2;
+		if (count == 0)
+			break;
+
+		/* Split it up, with any slack going to the last block. */
+		csize = GET_SIZE(HDRP(bp));
+		prev = GET_PREV_ALLOC(HDRP(bp));
+		for (i = 0; i < count; i++) {
+			PUT(HDRP(bp), PACK(i < count - 1 ? asize :
+			    csize - i * asize, prev | 1) | CANARY(bp));
+			ptrs[done++] = bp;
+			prev = PREV_ALLOC;
+			bp += asize;
+		}
+	}
+	HEAP_UNLOCK(ar);
+	return (done);
+}
 
-	if (prev_alloc && next_alloc) {                 /* Case 1 */
-		/* Bp stays same. */
-		bp = bp;	
-	} else if (prev_alloc && !next_alloc) {         /* Case 2 */
-		size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+/*
+ * Requires:
+ *   Each of the "n" pointers in "ptrs" is either the address of an
+ *   allocated block or NULL.
+ *
+ * Effects:
+ *   Free every block in "ptrs", leaving "ptrs" in no particular order.
+ *   Blocks that are adjacent in the heap are joined first, so that each
+ *   run of them is coalesced with its neighbors only once.
+ */
+void
+mm_free_batch(void **ptrs, size_t n)
+{
+	struct mm_arena *ar;
+	size_t i, j, m, size;
+	char *bp;
+
+	/* Free the blocks that skip the heap, keeping the others. */
+	for (i = m = 0; i < n; i++) {
+		if ((bp = ptrs[i]) == NULL)
+			continue;
+		if ((ar = arena_of(bp)) == NULL || !batch_heap_block(ar, bp))
+			mm_free(bp);
+		else {
+#ifdef MM_HARDEN
+			harden_check(ar, bp, "mm_free_batch");
+#endif
+			ptrs[m++] = bp;
+		}
+	}
 
-		/* Remove next. */
-		list_remove((struct block_list *)NEXT_BLKP(bp));
+	qsort(ptrs, m, sizeof(void *), ptr_compare);
+	for (i = 0; i < m; i = j) {
+		bp = ptrs[i];
+		ar = arena_of(bp);
+		size = GET_SIZE(HDRP(bp));
+		for (j = i + 1; j < m && (char *)ptrs[j] == bp + size; j++)
+			size += GET_SIZE(HDRP(ptrs[j]));
+
+		HEAP_LOCK(ar);
+		PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)) | 1));
+		heap_free_now(ar, bp);
+		HEAP_UNLOCK(ar);
+	}
+}
 
-		PUT(HDRP(bp), PACK(size, 0));
-		PUT(FTRP(bp), PACK(size, 0));
-	} else if (!prev_alloc && next_alloc) {         /* Case 3 */
-		size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+/*
+ * Requires:
+ *   "alignment" is a power of two.
+ *
+ * Effects:
+ *   Allocate a block with at least "size" bytes of payload whose address is
+ *   a multiple of "alignment".  The slack in front of the block goes back
+ *   to the free lists.  Blocks aligned more strictly than usual always come
+ *   from the heap, however large they are.  Returns the address of this
+ *   block if the allocation was successful and NULL otherwise.
+ */
+void *
+mm_memalign(size_t alignment, size_t size)
+{
+	size_t asize;      /* Adjusted block size */
+	struct mm_arena *ar;
+	void *bp;
 
-		/* Remove prev. */
-		list_remove((struct block_list *)PREV_BLKP(bp)); 
+	/* Ignore spurious requests. */
+	if (size == 0 || alignment == 0 || (alignment & (alignment - 1)) != 0)
+		return (NULL);
 
-		PUT(FTRP(bp), PACK(size, 0));
-		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-		bp = PREV_BLKP(bp);
-	} else {                                        /* Case 4 */
-		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
-		    GET_SIZE(FTRP(NEXT_BLKP(bp)));
+	/* Every block is already ALIGN_SIZE-aligned. */
+	if (alignment <= ALIGN_SIZE)
+		return (mm_malloc(size));
 
-		/* Remove prev and next. */
-		list_remove((struct block_list *)PREV_BLKP(bp));
-		list_remove((struct block_list *)NEXT_BLKP(bp));
+	/* Neither may wrap the arithmetic of heap_malloc_aligned. */
+	if (alignment > (SIZE_MAX - 4 * DSIZE) / 4 ||
+	    size > SIZE_MAX - 2 * alignment - 4 * DSIZE)
+		return (NULL);
+	if ((ar = arena_self()) == NULL)
+		return (NULL);
 
-		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-		PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
-		bp = PREV_BLKP(bp);
-	}
+	/* Adjust block size to include overhead and alignment reqs. */
+	if (size <= DSIZE + WSIZE)
+		asize = 2 * DSIZE;
+	else
+		asize = ALIGN_SIZE * 
+		    ((size + WSIZE + (ALIGN_SIZE - 1)) / ALIGN_SIZE);
 
-	/* Insert corresponding bp. */
-	list_insert(bp, size);
+	HEAP_LOCK(ar);
+	bp = heap_malloc_aligned(ar, alignment, asize);
+	CHECK_SAMPLE(ar);
+	HEAP_UNLOCK(ar);
 	return (bp);
 }
 
-/* 
+/*
  * Requires:
- *   None.
+ *   "alignment" is a power of two.
  *
  * Effects:
- *   Extend the heap with a free block and return that block's address.
+ *   Allocate a zeroed block for an array of "nmemb" elements of "size"
+ *   bytes each, like mm_memalign.  Returns the address of this block if the
+ *   allocation was successful and NULL otherwise.
  */
-static void *
-extend_heap(size_t words) 
+void *
+mm_aligned_calloc(size_t alignment, size_t nmemb, size_t size)
 {
-	size_t size;
 	void *bp;
 
-	/* Allocate an even number of words to maintain alignment. */
-	size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-	if ((bp = mem_sbrk(size)) == (void *)-1)  
+	if (nmemb != 0 && size > SIZE_MAX / nmemb)
 		return (NULL);
-
-	/* Initialize free block header/footer and the epilogue header. */
-	PUT(HDRP(bp), PACK(size, 0));         /* Free block header */
-	PUT(FTRP(bp), PACK(size, 0));         /* Free block footer */
-	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
-
-	/* Coalesce if the previous block was free. */
-	return (coalesce(bp));
+	if ((bp = mm_memalign(alignment, nmemb * size)) != NULL)
+		memset(bp, 0, nmemb * size);
+	return (bp);
 }
 
 /*
@@ -348,58 +1129,1342 @@ extend_heap(size_t words)
  *   None.
  *
  * Effects:
- *   Find a fit for a block with "asize" bytes.  Returns that block's address
- *   or NULL if no suitable block was found. 
+ *   Create an empty region.  Returns the region if it was created and NULL
+ *   otherwise.
  */
-static void *
-find_fit(size_t asize)
+struct mm_region *
+mm_region_create(void)
 {
-	
-	struct block_list *bp; 
+	struct mm_region *rg;
 
-	/* Search for the first fit. */
-	for (int i = seg_index(asize); i < SEGSIZE; i++) {
-		
-		/* Search for fit from every index of seg_first. */
-		for (bp = seg_first[i].next_list; bp && bp != &seg_first[i]; 
-		    bp = bp->next_list) {
-			if (asize <= GET_SIZE(HDRP(bp)))
-				return (void*)bp;
-		}
-	}
-	/* No fit was found. */
-	return (NULL);
-	
+	if ((rg = mm_malloc(sizeof(struct mm_region))) == NULL)
+		return (NULL);
+	rg->chunks = NULL;
+	rg->bump = rg->limit = NULL;
+	return (rg);
 }
 
-/* 
+/*
  * Requires:
- *   "bp" is the address of a free block that is at least "asize" bytes.
+ *   "rg" is a region that has not been destroyed.
  *
  * Effects:
- *   Place a block of "asize" bytes at the start of the free block "bp" and
- *   split that block if the remainder would be at least the minimum block
- *   size. 
+ *   Allocate an object of at least "size" bytes in the region "rg", unless
+ *   "size" is zero.  Returns the address of this object if the allocation
+ *   was successful and NULL otherwise.
  */
-static void
-place(void *bp, size_t asize)
+void *
+mm_region_alloc(struct mm_region *rg, size_t size)
 {
-	size_t csize = GET_SIZE(HDRP(bp));   
-	list_remove(bp);
-	if ((csize - asize) >= (2 * DSIZE)) { 
-		PUT(HDRP(bp), PACK(asize, 1));
-		PUT(FTRP(bp), PACK(asize, 1));
-		bp = NEXT_BLKP(bp);
-		PUT(HDRP(bp), PACK(csize - asize, 0));
-		PUT(FTRP(bp), PACK(csize - asize, 0));
-
-		/* Place block after removal.*/
-		list_insert(bp, csize - asize);
-	} else {
-		PUT(HDRP(bp), PACK(csize, 1));
-		PUT(FTRP(bp), PACK(csize, 1));
-	}
-}
+	struct region_chunk *chunk;
+	void *bp;
+
+	/* Ignore spurious requests. */
+	if (size == 0 || size > SIZE_MAX - REGION_HDR - ALIGN_SIZE)
+		return (NULL);
+	size = ALIGN_SIZE * ((size + ALIGN_SIZE - 1) / ALIGN_SIZE);
+
+	/* Most objects fit in the chunk being filled. */
+	if (size <= (size_t)(rg->limit - rg->bump)) {
+		bp = rg->bump;
+		rg->bump += size;
+		return (bp);
+	}
+
+	/* A large object goes in a chunk of its own, behind that chunk. */
+	if (size > REGION_LARGE) {
+		if ((chunk = mm_malloc(REGION_HDR + size)) == NULL)
+			return (NULL);
+		if (rg->chunks == NULL) {
+			chunk->next = NULL;
+			rg->chunks = chunk;
+		} else {
+			chunk->next = rg->chunks->next;
+			rg->chunks->next = chunk;
+		}
+		return ((char *)chunk + REGION_HDR);
+	}
+
+	/* Otherwise, start a new chunk. */
+	if ((chunk = mm_malloc(REGION_CHUNK)) == NULL)
+		return (NULL);
+	chunk->next = rg->chunks;
+	rg->chunks = chunk;
+	bp = (char *)chunk + REGION_HDR;
+	rg->bump = (char *)bp + size;
+	rg->limit = (char *)chunk + REGION_CHUNK;
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   "rg" is a region that has not been destroyed, or NULL.
+ *
+ * Effects:
+ *   Free every object in the region "rg", and the region itself.
+ */
+void
+mm_region_destroy(struct mm_region *rg)
+{
+	struct region_chunk *chunk;
+
+	if (rg == NULL)
+		return;
+	while ((chunk = rg->chunks) != NULL) {
+		rg->chunks = chunk->next;
+		mm_free(chunk);
+	}
+	mm_free(rg);
+}
+
+/*
+ * Requires:
+ *   "param" is one of the MM_* parameters in mm.h.
+ *
+ * Effects:
+ *   Set the tunable parameter "param" to "value".  Returns 1 if the
+ *   parameter was set and 0 if "param" or "value" is invalid.
+ */
+int
+mm_mallopt(int param, int value)
+{
+	switch (param) {
+	case MM_REALLOC_GROWTH:
+		if (value < 100)
+			return (0);
+		realloc_growth = value;
+		return (1);
+	case MM_FIT_POLICY:
+		if (value != MM_FIT_FIRST && value != MM_FIT_BEST &&
+		    value != MM_FIT_ADDRESS)
+			return (0);
+		fit_request = value;
+		return (1);
+	case MM_FIT_PROBES:
+		if (value < 1)
+			return (0);
+		fit_probes = value;
+		return (1);
+	case MM_MMAP_THRESHOLD:
+		if (value < 1)
+			return (0);
+		mmap_threshold = value;
+		return (1);
+	case MM_TRIM_THRESHOLD:
+		trim_threshold = (value < 0) ? SIZE_MAX : (size_t)value;
+		return (1);
+	case MM_DEFER_COALESCE:
+		defer_coalesce = (value != 0);
+		return (1);
+	case MM_NUMA:
+		numa_request = (value != 0);
+		return (1);
+	case MM_CHECK_INTERVAL:
+		if (value < 0)
+			return (0);
+		check_interval = value;
+		return (1);
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Requires:
+ *   "ptr" is either the address of an allocated block or NULL.
+ *
+ * Effects:
+ *   Returns the number of bytes of payload that the block "ptr" holds,
+ *   which is at least the size it was allocated with, or 0 if "ptr" is
+ *   NULL.
+ */
+size_t
+mm_usable_size(void *ptr)
+{
+	struct mm_arena *ar;
+	struct slab_run *run;
+
+	if (ptr == NULL)
+		return (0);
+	ar = arena_of(ptr);
+#ifdef MM_HARDEN
+	harden_check(ar, ptr, "mm_usable_size");
+#endif
+	if (ar == NULL)
+		return (GET_SIZE(HDRP(ptr)) - DSIZE);
+	if ((run = slab_run_of(ar, ptr)) != NULL)
+		return (run->size);
+	return (GET_SIZE(HDRP(ptr)) - WSIZE);
+}
+
+/*
+ * Requires:
+ *   "st" points to a struct mm_stats.
+ *
+ * Effects:
+ *   Fill in "st" with the shape of every heap and the counts of events
+ *   since mm_init.  Every free block is visited, so this takes time in
+ *   proportion to their number.  Blocks in thread caches and slab runs
+ *   count as allocated.
+ */
+void
+mm_stats(struct mm_stats *st)
+{
+	struct mm_arena *ar;
+	int i;
+
+	_Static_assert(MM_STATS_CLASSES >= SEGSIZE + 1,
+	    "MM_STATS_CLASSES must cover the size class table");
+	memset(st, 0, sizeof(*st));
+	st->classes = SEGSIZE + 1;
+	for (i = 0; i < SEGSIZE; i++)
+		st->class_min[i] = seg_min_size(i);
+	st->class_min[SEGSIZE] = TREE_MIN;
+
+	for (i = 0; i < MM_ARENAS; i++) {
+		if ((ar = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE)) ==
+		    NULL)
+			continue;
+		HEAP_LOCK(ar);
+		arena_stats(ar, st);
+		HEAP_UNLOCK(ar);
+	}
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns 1 if the memory manager may be called by several threads at
+ *   once and 0 otherwise.
+ */
+int
+mm_thread_safe(void)
+{
+#ifdef MM_THREADS
+	return (1);
+#else
+	return (0);
+#endif
+}
+
+/*
+ * The following routines are internal helper routines.  In the thread-safe
+ * build, every routine that touches an arena's heap must be called with
+ * that arena's lock held.
+ */
+
+/*
+ * Requires:
+ *   "id" is the index of a memlib arena whose heap is empty.
+ *
+ * Effects:
+ *   Create an arena in memlib arena "id" with an initial free block of
+ *   CHUNKSIZE bytes.  Returns the arena if it was successfully initialized
+ *   and NULL otherwise.
+ */
+static struct mm_arena *
+arena_init(int id)
+{
+	struct mm_arena *ar;
+	char *heap_listp;
+	size_t mapsize;
+
+	/* Place the arena's pages on its node before touching any. */
+	if (numa_arenas || mem_arena_node(id) >= 0)
+		mem_arena_bind(id, numa_arenas ? arena_node(id) : -1);
+
+	/* Initialize memory for storing the arena in the heap. */
+	if ((ar = mem_arena_sbrk(id, DSIZE * ((sizeof(struct mm_arena) +
+	    DSIZE - 1) / DSIZE))) == (void *)-1)
+		return (NULL);
+
+	/* Initially every size class is empty. */
+	memset(&ar->segs, 0, sizeof(struct seg_table));
+	memset(ar->slab_partial, 0, sizeof(ar->slab_partial));
+	memset(ar->slab_demand, 0, sizeof(ar->slab_demand));
+	ar->quick = quick_tables[id];
+	memset(ar->quick, 0, sizeof(quick_tables[id]));
+	ar->quick_bytes = 0;
+	ar->heap_lo = mem_arena_lo(id);
+	ar->id = id;
+	ar->check_bp = NULL;
+	ar->check_fp = NULL;
+	ar->check_index = 0;
+	ar->check_calls = 0;
+	ar->stat_splits = ar->stat_coalesces = 0;
+	ar->stat_fits = ar->stat_probes = 0;
+	ar->stat_rounded = ar->stat_round_bytes = 0;
+
+	/*
+	 * Only the pages that an earlier heap reached can have bits left
+	 * set in the run map.
+	 */
+	ar->slab_map = slab_maps[id];
+	mapsize = ((size_t)((char *)mem_arena_fresh(id) - ar->heap_lo) /
+	    RUN_SIZE + 7) / 8;
+	memset(ar->slab_map, 0, MIN(mapsize, SLAB_MAP_BYTES));
+#ifdef MM_THREADS
+	pthread_mutex_init(&ar->lock, NULL);
+	ar->remote = NULL;
+#endif
+
+	/* Create the initial empty heap. */
+	if ((heap_listp = mem_arena_sbrk(id, 4 * WSIZE)) == (void *)-1)
+		return (NULL);
+	
+	PUT(heap_listp, 0);                            /* Alignment padding */
+	PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1)); /* Prologue header */ 
+	PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */ 
+	PUT(heap_listp + (3 * WSIZE), PACK(0, PREV_ALLOC | 1)); /* Epilogue */
+	ar->heap_listp = heap_listp + 2 * WSIZE;
+	
+	/* Extend the empty heap with a free block of CHUNKSIZE bytes. */
+	if (extend_heap(ar, CHUNKSIZE / WSIZE) == NULL)
+		return (NULL);
+	return (ar);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block.
+ *
+ * Effects:
+ *   Returns the arena whose heap holds "bp", or NULL if "bp" is a huge
+ *   block with a region of its own.
+ */
+static struct mm_arena *
+arena_of(void *bp)
+{
+	int id = mem_arena_of(bp);
+
+	if (id < 0)
+		return (NULL);
+#ifdef MM_THREADS
+	return (__atomic_load_n(&arenas[id], __ATOMIC_ACQUIRE));
+#else
+	return (arenas[0]);
+#endif
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the calling thread's arena, initializing it if needed, or NULL
+ *   if it could not be initialized.
+ */
+static struct mm_arena *
+arena_self(void)
+{
+#ifdef MM_THREADS
+	struct mm_arena *ar;
+	int id, narenas, node, nodes;
+
+	/*
+	 * Hash new threads onto the arenas round-robin, using only the arenas
+	 * of their own node under MM_NUMA.
+	 */
+	if (arena_slot == 0) {
+		id = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED);
+		narenas = MIN(MM_ARENAS, mem_arena_count());
+		nodes = mem_node_count();
+		if (numa_arenas && (node = mem_node_self()) < narenas)
+			id = node + nodes * (id % ((narenas - node + nodes - 1) /
+			    nodes));
+		arena_slot = 1 + id % narenas;
+		__atomic_fetch_add(&arena_threads[arena_slot - 1], 1,
+		    __ATOMIC_SEQ_CST);
+
+		/* Uncount the thread, and flush its cache, when it exits. */
+		pthread_once(&tcache_once, tcache_key_create);
+		pthread_setspecific(tcache_key, &tcache);
+	}
+	id = arena_slot - 1;
+	if ((ar = __atomic_load_n(&arenas[id], __ATOMIC_ACQUIRE)) != NULL)
+		return (ar);
+
+	/* First use of this arena since mm_init. */
+	pthread_mutex_lock(&arena_init_lock);
+	if ((ar = arenas[id]) == NULL && (ar = arena_init(id)) != NULL)
+		__atomic_store_n(&arenas[id], ar, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&arena_init_lock);
+	return (ar);
+#else
+	return (arenas[0]);
+#endif
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the NUMA node for arena "id" under MM_NUMA.  The arenas are
+ *   dealt out to the nodes in turn, except that the single-threaded
+ *   build's only arena goes to the node of the thread calling mm_init.
+ */
+static int
+arena_node(int id)
+{
+#ifdef MM_THREADS
+	return (id % mem_node_count());
+#else
+	(void)id;
+	return (mem_node_self());
+#endif
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Allocate a huge block of at least "size" bytes in a region of its own,
+ *   outside every heap.  The block's header holds the size of the region,
+ *   and the payload starts DSIZE bytes into the region.  Returns the
+ *   address of this block if the allocation was successful and NULL
+ *   otherwise.
+ */
+static void *
+map_malloc(size_t size)
+{
+	size_t pagesize = mem_pagesize();
+	char *region;
+
+	if (size > SIZE_MAX - DSIZE - pagesize)
+		return (NULL);
+	size = (size + DSIZE + pagesize - 1) & ~(pagesize - 1);
+
+	/* The region's size must fit in the block's header. */
+	if ((size & SIZE_MASK) != size)
+		return (NULL);
+	MAP_LOCK();
+	region = mem_map(size);
+	MAP_UNLOCK();
+	if (region == (void *)-1)
+		return (NULL);
+	PUT(region + WSIZE, PACK(size, 1) | CANARY(region + DSIZE));
+	return (region + DSIZE);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a block allocated by map_malloc.
+ *
+ * Effects:
+ *   Free the huge block "bp", returning its region to the system.
+ */
+static void
+map_free(void *bp)
+{
+	MAP_LOCK();
+	mem_unmap((char *)bp - DSIZE);
+	MAP_UNLOCK();
+}
+
+/* 
+ * Requires:
+ *   "asize" is an adjusted block size.
+ *
+ * Effects:
+ *   Allocate a block of at least "asize" bytes from the heap, extending the
+ *   heap if no free block fits.  Returns the address of this block if the
+ *   allocation was successful and NULL otherwise.
+ */
+static void *
+heap_malloc(struct mm_arena *ar, size_t asize)
+{
+	size_t extendsize; /* Amount to extend heap if no fit */
+	struct block_list **bin;
+	void *bp;
+
+	/* Take back the blocks that other threads have freed. */
+	REMOTE_DRAIN(ar);
+
+	/* Reuse a binned block of exactly "asize" bytes as it is. */
+	if (ar->quick_bytes > 0 && asize <= QUICK_MAX &&
+	    *(bin = &ar->quick[QUICK_BIN(asize)]) != NULL) {
+		bp = *bin;
+		*bin = NEXT_LIST(*bin);
+		ar->quick_bytes -= asize;
+		return (bp);
+	}
+
+	/*
+	 * Search the free list for a fit, coalescing the bins and then this
+	 * thread's cache if none does.
+	 */
+	if ((bp = find_fit(ar, asize)) == NULL && ar->quick_bytes > 0) {
+		quick_flush(ar);
+		bp = find_fit(ar, asize);
+	}
+	if (bp == NULL && TCACHE_RETURN(ar))
+		bp = find_fit(ar, asize);
+	if (bp != NULL) {
+		place(ar, bp, asize);
+		return (bp);
+	}
+
+	/* No fit found.  Get more memory and place the block. */
+	extendsize = MAX(asize, chunk_size(ar));
+	if ((bp = extend_heap(ar, extendsize / WSIZE)) == NULL)  
+		return (NULL);
+	place(ar, bp, asize);
+	return (bp);
+}
+
+/* 
+ * Requires:
+ *   "align" is a power of two that is a multiple of ALIGN_SIZE, and "asize"
+ *   is an adjusted block size.
+ *
+ * Effects:
+ *   Allocate a block of at least "asize" bytes whose address is a multiple
+ *   of "align".  The slack in front of the block is split off as a free
+ *   block.  Returns the address of this block if the allocation was
+ *   successful and NULL otherwise.
+ */
+static void *
+heap_malloc_aligned(struct mm_arena *ar, size_t align, size_t asize)
+{
+	struct block_list *fp;
+	struct tree_node *np;
+	size_t csize, gap, have, probes = 0;
+	char *bp = NULL, *end;
+	int index;
+
+	/* Try a few free blocks with room for an aligned block of "asize". */
+	for (index = seg_index(asize); index >= 0 && bp == NULL &&
+	    probes < ALIGN_PROBES; index = seg_next_nonempty(ar, index)) {
+		for (fp = ar->segs.seg_first[index]; fp != NULL &&
+		    probes < ALIGN_PROBES; fp = NEXT_LIST(fp), probes++) {
+			if (aligned_gap(fp, align) + asize <=
+			    GET_SIZE(HDRP(fp))) {
+				bp = (char *)fp;
+				break;
+			}
+		}
+	}
+
+	/* Then the smallest large blocks that are at least "asize" bytes. */
+	for (np = tree_find(ar, asize); np != NULL && bp == NULL &&
+	    probes < ALIGN_PROBES; np = tree_next(np), probes++) {
+		if (aligned_gap(np, align) + asize <= GET_SIZE(HDRP(np)))
+			bp = (char *)np;
+	}
+
+	/* Failing those, any block with room for the largest gap will do. */
+	if (bp == NULL)
+		bp = find_fit(ar, asize + align + 2 * DSIZE);
+
+	/*
+	 * Otherwise, coalesce the bins and try again, or extend the heap by
+	 * just enough for an aligned block to fit in the free block at the
+	 * end of the heap.
+	 */
+	if (bp == NULL && ar->quick_bytes > 0) {
+		quick_flush(ar);
+		return (heap_malloc_aligned(ar, align, asize));
+	}
+	if (bp == NULL) {
+		end = (char *)mem_arena_hi(ar->id) + 1;
+		have = GET_PREV_ALLOC(end - WSIZE) ? 0 : GET_SIZE(end - DSIZE);
+		gap = aligned_gap(end - have, align);
+		if (gap + asize <= have)
+			bp = end - have;
+		else if ((bp = extend_heap(ar, (gap + asize - have) / WSIZE)) ==
+		    NULL)
+			return (NULL);
+	}
+
+	/* Split the slack in front off as a free block of its own. */
+	if ((gap = aligned_gap(bp, align)) > 0) {
+		ar->stat_splits++;
+		csize = GET_SIZE(HDRP(bp));
+		list_remove(ar, (struct block_list *)bp);
+		PUT(HDRP(bp), PACK(gap, GET_PREV_ALLOC(HDRP(bp))));
+		PUT(FTRP(bp), PACK(gap, 0));
+		list_insert(ar, (struct block_list *)bp, gap);
+		bp += gap;
+		PUT(HDRP(bp), PACK(csize - gap, 0));
+		PUT(FTRP(bp), PACK(csize - gap, 0));
+		list_insert(ar, (struct block_list *)bp, csize - gap);
+	}
+	place(ar, bp, asize);
+	return (bp);
+}
+
+/* 
+ * Requires:
+ *   "bp" is the address of an allocated block.
+ *
+ * Effects:
+ *   Return the block "bp" to the heap.  In deferred mode, a small block is
+ *   put in its quick bin instead.
+ */
+static void
+heap_free(struct mm_arena *ar, void *bp)
+{
+	struct block_list *fp = bp;
+	size_t size = GET_SIZE(HDRP(bp));
+
+	if (!defer_coalesce || size > QUICK_MAX) {
+		heap_free_now(ar, bp);
+		return;
+	}
+	SET_NEXT_LIST(fp, ar->quick[QUICK_BIN(size)]);
+	ar->quick[QUICK_BIN(size)] = fp;
+	if ((ar->quick_bytes += size) > QUICK_BUDGET)
+		quick_flush(ar);
+}
+
+/* 
+ * Requires:
+ *   "bp" is the address of an allocated block.
+ *
+ * Effects:
+ *   Return the block "bp" to the heap, coalescing it with its neighbors.
+ *   If that leaves a free block of more than "trim_threshold" bytes at the
+ *   end of the heap, the heap is trimmed.
+ */
+static void
+heap_free_now(struct mm_arena *ar, void *bp)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+
+	PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
+	PUT(FTRP(bp), PACK(size, 0));
+	CLR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+	bp = coalesce(ar, bp);
+	if (GET_SIZE(HDRP(bp)) > trim_threshold &&
+	    GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0)
+		heap_trim(ar, bp);
+}
+
+/* 
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Empty the quick bins, coalescing every block in them.
+ */
+static void
+quick_flush(struct mm_arena *ar)
+{
+	struct block_list *fp;
+	int bin;
+
+	for (bin = 0; bin < QUICK_BINS; bin++) {
+		while ((fp = ar->quick[bin]) != NULL) {
+			ar->quick[bin] = NEXT_LIST(fp);
+			heap_free_now(ar, fp);
+		}
+	}
+	ar->quick_bytes = 0;
+}
+
+/* 
+ * Requires:
+ *   "bp" is the address of the free block at the end of the heap.
+ *
+ * Effects:
+ *   Shrink the heap, giving back whole pages of "bp" to the system, until
+ *   at most CHUNKSIZE bytes of it are left.
+ */
+static void
+heap_trim(struct mm_arena *ar, void *bp)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+	size_t release;
+
+	if (size <= CHUNKSIZE)
+		return;
+	release = (size - CHUNKSIZE) / mem_pagesize() * mem_pagesize();
+	if (release == 0)
+		return;
+	list_remove(ar, bp);
+
+	/* The epilogue moves, so a checker walk that was to visit it restarts. */
+	if (ar->check_bp == NEXT_BLKP(bp))
+		ar->check_bp = NULL;
+	size -= release;
+	PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
+	PUT(FTRP(bp), PACK(size, 0));
+	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
+	mem_arena_sbrk(ar->id, -(intptr_t)release);
+	list_insert(ar, bp, size);
+}
+
+/* 
+ * Requires:
+ *   "bp" is the address of an allocated block of less than "asize" bytes.
+ *
+ * Effects:
+ *   Grow the block "bp" in place to at least "asize" bytes by absorbing the
+ *   free block after it, first extending the heap if "bp" is the last
+ *   allocated block.  Any remainder of at least the minimum block size is
+ *   split off.  Returns true if the block was grown and false otherwise, in
+ *   which case it is left untouched.
+ */
+static bool
+heap_grow(struct mm_arena *ar, void *bp, size_t asize)
+{
+	size_t csize = GET_SIZE(HDRP(bp));
+	char *next = NEXT_BLKP(bp);
+	size_t nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+	size_t prev = GET_PREV_ALLOC(HDRP(bp));
+	size_t total;
+
+	if (csize + nsize < asize) {
+		/* Only a block at the end of the heap can have the heap grown. */
+		if (GET_SIZE(HDRP(nsize == 0 ? next : NEXT_BLKP(next))) != 0)
+			return (false);
+
+		/*
+		 * The new free block starts at, or coalesces into, "next",
+		 * and must be large enough to hold its links and footer.
+		 */
+		if (extend_heap(ar, MAX(asize - csize - nsize, 2 * DSIZE) /
+		    WSIZE) == NULL)
+			return (false);
+		nsize = GET_SIZE(HDRP(next));
+	}
+
+	/* Absorb the next block, splitting off the remainder. */
+	total = csize + nsize;
+	list_remove(ar, (struct block_list *)next);
+	if ((total - asize) >= (2 * DSIZE)) {
+		ar->stat_splits++;
+		PUT(HDRP(bp), PACK(asize, prev | 1) | CANARY(bp));
+		next = NEXT_BLKP(bp);
+		PUT(HDRP(next), PACK(total - asize, PREV_ALLOC));
+		PUT(FTRP(next), PACK(total - asize, 0));
+		list_insert(ar, (struct block_list *)next, total - asize);
+	} else {
+		PUT(HDRP(bp), PACK(total, prev | 1) | CANARY(bp));
+		SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+	}
+	CHECK_FORGET(ar, bp);
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a newly freed block.
+ *
+ * Effects:
+ *   Perform boundary tag coalescing.  Returns the address of the coalesced
+ *   block.
+ */
+static void *
+coalesce(struct mm_arena *ar, void *bp) 
+{
+	size_t size = GET_SIZE(HDRP(bp));
+	bool prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+	bool next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+
+	if (prev_alloc && next_alloc) {                 /* Case 1 */
+		/* Bp stays same. */
+		bp = bp;	
+	} else if (prev_alloc && !next_alloc) {         /* Case 2 */
+		size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+
+		/* Remove next. */
+		list_remove(ar, (struct block_list *)NEXT_BLKP(bp));
+		ar->stat_coalesces++;
+
+		PUT(HDRP(bp), PACK(size, PREV_ALLOC));
+		PUT(FTRP(bp), PACK(size, 0));
+	} else if (!prev_alloc && next_alloc) {         /* Case 3 */
+		size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+
+		/* Remove prev. */
+		list_remove(ar, (struct block_list *)PREV_BLKP(bp)); 
+		ar->stat_coalesces++;
+
+		PUT(FTRP(bp), PACK(size, 0));
+		PUT(HDRP(PREV_BLKP(bp)), PACK(size, PREV_ALLOC));
+		bp = PREV_BLKP(bp);
+	} else {                                        /* Case 4 */
+		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
+		    GET_SIZE(FTRP(NEXT_BLKP(bp)));
+
+		/* Remove prev and next. */
+		list_remove(ar, (struct block_list *)PREV_BLKP(bp));
+		list_remove(ar, (struct block_list *)NEXT_BLKP(bp));
+		ar->stat_coalesces += 2;
+
+		PUT(HDRP(PREV_BLKP(bp)), PACK(size, PREV_ALLOC));
+		PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+		bp = PREV_BLKP(bp);
+	}
+
+	/* Insert corresponding bp. */
+	list_insert(ar, bp, size);
+	CHECK_FORGET(ar, bp);
+	return (bp);
+}
+
+/* 
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Extend the heap with a free block and return that block's address.
+ *   Returns NULL if the heap cannot grow by "words" words.
+ */
+static void *
+extend_heap(struct mm_arena *ar, size_t words) 
+{
+	size_t size;
+	void *bp;
+
+	/* More than an arena holds would be a negative increment to sbrk. */
+	if (words > mem_arena_maxsize() / WSIZE)
+		return (NULL);
+
+	/* Allocate an even number of words to maintain alignment. */
+	size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
+	if ((bp = mem_arena_sbrk(ar->id, size)) == (void *)-1)  
+		return (NULL);
+
+	/* 
+	 * Initialize free block header/footer and the epilogue header.  The
+	 * old epilogue header becomes the new block's header.
+	 */
+	PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)))); /* Header */
+	PUT(FTRP(bp), PACK(size, 0));                      /* Footer */
+	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));              /* Epilogue */
+
+	/* Coalesce if the previous block was free. */
+	return (coalesce(ar, bp));
+}
+
+/*
+ * Requires:
+ *   The lock of "ar" is held.
+ *
+ * Effects:
+ *   Returns the least number of bytes to extend the heap of "ar" by when no
+ *   fit is found: CHUNKSIZE or, if CHUNK_SHIFT is set and it is more,
+ *   1/2^CHUNK_SHIFT of the heap, up to CHUNK_MAX.  Growing geometrically,
+ *   a heap is extended a number of times logarithmic in its size.
+ */
+static size_t
+chunk_size(struct mm_arena *ar)
+{
+#if CHUNK_SHIFT > 0
+	size_t size = mem_arena_heapsize(ar->id) >> CHUNK_SHIFT;
+
+	return (MIN(MAX(size, CHUNKSIZE), CHUNK_MAX));
+#else
+	(void)ar;
+	return (CHUNKSIZE);
+#endif
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Find a fit for a block with "asize" bytes under the placement policy.
+ *   Large blocks always come from the tree, which gives the best fit under
+ *   every policy.  Returns that block's address or NULL if no suitable
+ *   block was found. 
+ */
+static void *
+find_fit(struct mm_arena *ar, size_t asize)
+{
+	struct block_list *bp, *best = NULL; 
+	size_t size, best_size = SIZE_MAX;
+	int index = seg_index(asize), probes = 0;
+
+	/* A search of the tree counts as one probe. */
+	ar->stat_fits++;
+	if (asize >= TREE_MIN) {
+		ar->stat_probes++;
+		return (tree_find(ar, asize));
+	}
+
+	if (fit_policy == MM_FIT_FIRST) {
+		/* 
+		 * The class of "asize" may also hold smaller blocks, so search
+		 * it for the first fit.
+		 */
+		for (bp = ar->segs.seg_first[index]; bp != NULL;
+		    bp = NEXT_LIST(bp)) {
+			ar->stat_probes++;
+			if (asize <= GET_SIZE(HDRP(bp)))
+				return (bp);
+		}
+
+		/* Every block in a larger nonempty class, or the tree, fits. */
+		ar->stat_probes++;
+		if ((index = seg_next_nonempty(ar, index)) < 0)
+			return (tree_find(ar, asize));
+		return (ar->segs.seg_first[index]);
+	}
+
+	/*
+	 * Otherwise, take the tightest fit in the first class that has one.
+	 * Bounded best fit gives up after "fit_probes" fits.  In address
+	 * order, ties go to the block with the lowest address.
+	 */
+	for (; index >= 0; index = seg_next_nonempty(ar, index)) {
+		for (bp = ar->segs.seg_first[index]; bp != NULL;
+		    bp = NEXT_LIST(bp)) {
+			ar->stat_probes++;
+			if ((size = GET_SIZE(HDRP(bp))) < asize)
+				continue;
+			if (size < best_size) {
+				best = bp;
+				best_size = size;
+				if (size == asize)
+					return (best);
+			}
+			if (fit_policy == MM_FIT_BEST && ++probes >= fit_probes)
+				return (best);
+		}
+		if (best != NULL)
+			return (best);
+	}
+	ar->stat_probes++;
+	return (tree_find(ar, asize));
+}
+
+/* 
+ * Requires:
+ *   "bp" is the address of a free block that is at least "asize" bytes.
+ *
+ * Effects:
+ *   Place a block of "asize" bytes at the start of the free block "bp" and
+ *   split that block if the remainder would be at least the minimum block
+ *   size. 
+ */
+static void
+place(struct mm_arena *ar, void *bp, size_t asize)
+{
+	size_t csize = GET_SIZE(HDRP(bp));   
+	size_t prev = GET_PREV_ALLOC(HDRP(bp));
+	list_remove(ar, bp);
+	if ((csize - asize) >= (2 * DSIZE)) { 
+		ar->stat_splits++;
+		PUT(HDRP(bp), PACK(asize, prev | 1) | CANARY(bp));
+		bp = NEXT_BLKP(bp);
+		PUT(HDRP(bp), PACK(csize - asize, PREV_ALLOC));
+		PUT(FTRP(bp), PACK(csize - asize, 0));
+
+		/* Place block after removal.*/
+		list_insert(ar, bp, csize - asize);
+	} else {
+		PUT(HDRP(bp), PACK(csize, prev | 1) | CANARY(bp));
+		SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+	}
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block with at least "size" bytes of
+ *   payload, and "fresh" is what mem_arena_fresh returned for its heap
+ *   before the block was allocated.
+ *
+ * Effects:
+ *   Clear the first "size" bytes of the block's payload.  Bytes at or above
+ *   "fresh" have never been handed out, so only the links and footer that
+ *   the block held while it was free are cleared there.
+ */
+static void
+zero_block(void *bp, size_t size, void *fresh)
+{
+	size_t dirty, tail;
+
+	dirty = MAX(sizeof(struct tree_node), (char *)bp < (char *)fresh ?
+	    (size_t)((char *)fresh - (char *)bp) : 0);
+	if (dirty >= size) {
+		memset(bp, 0, size);
+		return;
+	}
+	memset(bp, 0, dirty);
+	tail = GET_SIZE(HDRP(bp)) - DSIZE;
+	if (tail < size)
+		memset((char *)bp + tail, 0, size - tail);
+}
+
+/*
+ * The following routines manage slab runs.
+ */
+
+/*
+ * Requires:
+ *   "size" is at most SLAB_MAX.
+ *
+ * Effects:
+ *   Allocate an object of at least "size" bytes from a run of its slab
+ *   class, creating a new run if the class has no free objects.  Returns
+ *   the address of the object if the allocation was successful and NULL
+ *   otherwise.
+ */
+static void *
+slab_malloc(struct mm_arena *ar, size_t size)
+{
+	int index = SLAB_INDEX(size);
+	struct slab_run *run = ar->slab_partial[index];
+	size_t page;
+	void *bp;
+
+	if (run == NULL) {
+		/* Carve a new run out of the heap. */
+		if ((run = heap_malloc_aligned(ar, RUN_SIZE, RUN_SIZE)) == NULL)
+			return (NULL);
+		run->size = SLAB_SIZE(index);
+		run->free_objs = NULL;
+		run->bump = RUN_OBJS(run);
+		run->nobjs = (RUN_SIZE - WSIZE - (RUN_OBJS(run) - (char *)run)) /
+		    run->size;
+		run->nfree = run->nobjs;
+		run->prev_run = NULL;
+		run->next_run = NULL;
+		ar->slab_partial[index] = run;
+
+		/* Record that the run's page holds slab objects. */
+		page = (size_t)((char *)run - ar->heap_lo) / RUN_SIZE;
+		__atomic_fetch_or(&ar->slab_map[page / 8], 1 << (page % 8),
+		    __ATOMIC_RELAXED);
+	}
+
+	/* Reuse a freed object, or else take the next untouched one. */
+	if ((bp = run->free_objs) != NULL)
+		run->free_objs = *(void **)bp;
+	else {
+		bp = run->bump;
+		run->bump += run->size;
+	}
+
+	/* A full run leaves the partial list, of which it is first. */
+	if (--run->nfree == 0) {
+		ar->slab_partial[index] = run->next_run;
+		if (run->next_run != NULL)
+			run->next_run->prev_run = NULL;
+	}
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated object in the run "run".
+ *
+ * Effects:
+ *   Free the object "bp".  If that leaves "run" empty, returns the run to
+ *   the heap.
+ */
+static void
+slab_free(struct mm_arena *ar, struct slab_run *run, void *bp)
+{
+	int index = SLAB_INDEX(run->size);
+	size_t page;
+
+	*(void **)bp = run->free_objs;
+	run->free_objs = bp;
+
+	if (run->nfree++ == 0) {
+		/* The run was full, so it rejoins the partial list. */
+		run->prev_run = NULL;
+		run->next_run = ar->slab_partial[index];
+		if (run->next_run != NULL)
+			run->next_run->prev_run = run;
+		ar->slab_partial[index] = run;
+	}
+	if (run->nfree == run->nobjs) {
+		/* Unlink the empty run. */
+		if (run->prev_run != NULL)
+			run->prev_run->next_run = run->next_run;
+		else
+			ar->slab_partial[index] = run->next_run;
+		if (run->next_run != NULL)
+			run->next_run->prev_run = run->prev_run;
+
+		/* Its page no longer holds slab objects. */
+		page = (size_t)((char *)run - ar->heap_lo) / RUN_SIZE;
+		__atomic_fetch_and(&ar->slab_map[page / 8],
+		    ~(1 << (page % 8)), __ATOMIC_RELAXED);
+		heap_free(ar, run);
+	}
+}
+
+/*
+ * Requires:
+ *   "size" is at most SLAB_MAX.
+ *
+ * Effects:
+ *   Counts a request for "size" bytes against its slab class.  Returns true
+ *   if the class has warmed up and the request should be served from a run.
+ */
+inline static bool
+slab_wanted(struct mm_arena *ar, size_t size)
+{
+	unsigned int *demand = &ar->slab_demand[SLAB_INDEX(size)];
+
+	if (__atomic_load_n(demand, __ATOMIC_RELAXED) >= SLAB_WARMUP)
+		return (true);
+	return (__atomic_add_fetch(demand, 1, __ATOMIC_RELAXED) > SLAB_WARMUP);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block or object in "ar".
+ *
+ * Effects:
+ *   Returns the run holding "bp" if "bp" is a slab object and NULL
+ *   otherwise.
+ */
+inline static struct slab_run *
+slab_run_of(struct mm_arena *ar, void *bp)
+{
+	size_t page = (size_t)((char *)bp - ar->heap_lo) / RUN_SIZE;
+
+	if ((__atomic_load_n(&ar->slab_map[page / 8], __ATOMIC_RELAXED) &
+	    (1 << (page % 8))) == 0)
+		return (NULL);
+	return ((struct slab_run *)((uintptr_t)bp & ~(uintptr_t)(RUN_SIZE - 1)));
+}
+
+/*
+ * The following routines manage the tree of large free blocks.
+ */
+
+/*
+ * Requires:
+ *   "a" and "b" are the addresses of free blocks.
+ *
+ * Effects:
+ *   Returns true if "a" orders before "b" in the tree and false otherwise.
+ */
+#define TREE_LESS(a, b)  (GET_SIZE(HDRP(a)) < GET_SIZE(HDRP(b)) || \
+    (GET_SIZE(HDRP(a)) == GET_SIZE(HDRP(b)) && (char *)(a) < (char *)(b)))
+
+/*
+ * Requires:
+ *   "np" is the address of a free block of at least TREE_MIN bytes that is
+ *   not in the tree.
+ *
+ * Effects:
+ *   Insert "np" into the tree, rebalancing it.
+ */
+static void
+tree_insert(struct mm_arena *ar, struct tree_node *np)
+{
+	struct tree_node **link = &ar->segs.tree_root;
+	struct tree_node *parent = NULL, *gp, *uncle;
+	int dir;
+
+	/* Insert np as a red leaf. */
+	while (*link != NULL) {
+		parent = *link;
+		link = &parent->child[!TREE_LESS(np, parent)];
+	}
+	np->child[0] = np->child[1] = NULL;
+	np->parent = parent;
+	np->red = true;
+	*link = np;
+
+	/* Repair any red node with a red parent. */
+	while ((parent = np->parent) != NULL && parent->red) {
+		/* The root is black, so a red parent has a parent. */
+		gp = parent->parent;
+		dir = (parent == gp->child[1]);
+		uncle = gp->child[!dir];
+		if (uncle != NULL && uncle->red) {
+			/* Push the grandparent's blackness down. */
+			parent->red = uncle->red = false;
+			gp->red = true;
+			np = gp;
+			continue;
+		}
+		if (np == parent->child[!dir]) {
+			/* Line np up with its parent. */
+			tree_rotate(ar, parent, dir);
+			np = parent;
+			parent = np->parent;
+		}
+		parent->red = false;
+		gp->red = true;
+		tree_rotate(ar, gp, !dir);
+	}
+	ar->segs.tree_root->red = false;
+}
+
+/*
+ * Requires:
+ *   "np" is the address of a block in the tree.
+ *
+ * Effects:
+ *   Remove "np" from the tree, rebalancing it.
+ */
+static void
+tree_remove(struct mm_arena *ar, struct tree_node *np)
+{
+	struct tree_node *child, *parent, *sib, *succ;
+	bool red;
+	int dir;
+
+	if (np->child[0] != NULL && np->child[1] != NULL) {
+		/* Move np's successor, which has no left child, into its place. */
+		for (succ = np->child[1]; succ->child[0] != NULL;
+		    succ = succ->child[0])
+			;
+		child = succ->child[1];
+		red = succ->red;
+		if ((parent = succ->parent) == np)
+			parent = succ;
+		else {
+			parent->child[0] = child;
+			if (child != NULL)
+				child->parent = parent;
+			succ->child[1] = np->child[1];
+			succ->child[1]->parent = succ;
+		}
+		succ->child[0] = np->child[0];
+		succ->child[0]->parent = succ;
+		succ->red = np->red;
+		tree_replace(ar, np, succ);
+	} else {
+		/* Splice np out. */
+		child = np->child[np->child[0] == NULL];
+		parent = np->parent;
+		red = np->red;
+		if (child != NULL)
+			child->parent = parent;
+		tree_replace(ar, np, child);
+	}
+	if (red)
+		return;
+
+	/*
+	 * A black node left the path to "child".  Walk up until the missing
+	 * black can be made up.  Since the path lost a black node, a NULL 
+	 * "child" always has a sibling.
+	 */
+	while (child != ar->segs.tree_root && (child == NULL || !child->red)) {
+		dir = (child == parent->child[1]);
+		sib = parent->child[!dir];
+		if (sib->red) {
+			/* Make the sibling black. */
+			sib->red = false;
+			parent->red = true;
+			tree_rotate(ar, parent, dir);
+			sib = parent->child[!dir];
+		}
+		if ((sib->child[0] == NULL || !sib->child[0]->red) &&
+		    (sib->child[1] == NULL || !sib->child[1]->red)) {
+			/* Take a black off the sibling's side, and go up. */
+			sib->red = true;
+			child = parent;
+			parent = child->parent;
+			continue;
+		}
+		if (sib->child[!dir] == NULL || !sib->child[!dir]->red) {
+			/* Make the sibling's far child red. */
+			sib->child[dir]->red = false;
+			sib->red = true;
+			tree_rotate(ar, sib, !dir);
+			sib = parent->child[!dir];
+		}
+		sib->red = parent->red;
+		parent->red = false;
+		sib->child[!dir]->red = false;
+		tree_rotate(ar, parent, dir);
+		child = ar->segs.tree_root;
+	}
+	if (child != NULL)
+		child->red = false;
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the smallest block in the tree that is at least "asize" bytes,
+ *   the lowest addressed one if several are, or NULL if there is none.
+ */
+static struct tree_node *
+tree_find(struct mm_arena *ar, size_t asize)
+{
+	struct tree_node *np = ar->segs.tree_root, *best = NULL;
+
+	while (np != NULL) {
+		if (GET_SIZE(HDRP(np)) >= asize) {
+			best = np;
+			np = np->child[0];
+		} else
+			np = np->child[1];
+	}
+	return (best);
+}
+
+/*
+ * Requires:
+ *   "np" is the address of a block in the tree.
+ *
+ * Effects:
+ *   Returns the block after "np" in the tree, or NULL if there is none.
+ */
+static struct tree_node *
+tree_next(struct tree_node *np)
+{
+	if (np->child[1] != NULL) {
+		for (np = np->child[1]; np->child[0] != NULL; np = np->child[0])
+			;
+		return (np);
+	}
+	while (np->parent != NULL && np == np->parent->child[1])
+		np = np->parent;
+	return (np->parent);
+}
+
+/*
+ * Requires:
+ *   "old" is the address of a block in the tree, and "np" is NULL or the
+ *   address of a block.
+ *
+ * Effects:
+ *   Make "np" the child of "old"'s parent, or the root, in place of "old".
+ */
+static void
+tree_replace(struct mm_arena *ar, struct tree_node *old, struct tree_node *np)
+{
+	if (np != NULL)
+		np->parent = old->parent;
+	if (old->parent == NULL)
+		ar->segs.tree_root = np;
+	else
+		old->parent->child[old == old->parent->child[1]] = np;
+}
+
+/*
+ * Requires:
+ *   "np" is the address of a block in the tree with a child on side !"dir".
+ *
+ * Effects:
+ *   Rotate the tree at "np" towards side "dir", so that its child on the
+ *   other side takes its place.
+ */
+static void
+tree_rotate(struct mm_arena *ar, struct tree_node *np, int dir)
+{
+	struct tree_node *up = np->child[!dir];
+
+	np->child[!dir] = up->child[dir];
+	if (up->child[dir] != NULL)
+		up->child[dir]->parent = np;
+	tree_replace(ar, np, up);
+	up->child[dir] = np;
+	np->parent = up;
+}
 
 /* 
  * The remaining routines are heap consistency checker routines. 
@@ -407,194 +2472,446 @@ place(void *bp, size_t asize)
 
 /*
  * Requires:
- *   "bp" is the address of a block.
+ *   "bp" is the address of a block in the heap of "ar", other than its
+ *   epilogue.
  *
  * Effects:
- *   Perform a check on the block "bp".
+ *   Perform a check on the block "bp" and its record in the next block.  A
+ *   free block is also checked to be linked into its size class or the
+ *   tree.
  */
 static void
-checkblock(void *bp) 
+checkblock(struct mm_arena *ar, void *bp) 
 {	
+	struct slab_run *run;
+	size_t size = GET_SIZE(HDRP(bp));
+
 	/* Check if the pointer is doubleword aligned. */
-	if ((uintptr_t)bp % DSIZE)
+	if ((uintptr_t)bp % ALIGN_SIZE)
 		printf("Error: %p is not doubleword aligned!\n", bp);
 
-	/* Check if the header matches with footer. */
-	if (GET(HDRP(bp)) != GET(FTRP(bp)))
-		printf("Error: header does not match footer!\n");
+	/* Check the prologue. */
+	if (bp == ar->heap_listp && (size != DSIZE || !GET_ALLOC(HDRP(bp))))
+		printf("Error: bad prologue header!\n");
+
+	/* Check the next block's record of this block. */
+	if (!GET_ALLOC(HDRP(bp)) != !GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))))
+		printf("Error: prev-alloc bit after %p is wrong!\n", bp);
 
-	int index = seg_index(GET_SIZE(HDRP(bp)));
-	struct block_list *i = seg_first;
 	if (!GET_ALLOC(HDRP(bp))) {
-		/* Check if free blocks are in the correct free list. */
-		while (i != NULL) {
-			if (i == bp) {
-				printf("Found %p in free list index %u\n", 
-				    bp, index);
-				return;
-			}
-			i = i->next_list;
+		/* Free blocks are coalesced with their neighbors. */
+		if (!GET_PREV_ALLOC(HDRP(bp)))
+			printf("Error: %p and the block before it are free "
+			    "and uncoalesced!\n", bp);
+		checkfree(ar, bp, size >= TREE_MIN ? SEGSIZE : seg_index(size));
+	} else if ((run = slab_run_of(ar, bp)) != NULL) {
+		/* Check a slab run's header against its block. */
+		if ((void *)run != bp || size < RUN_SIZE || run->size == 0 ||
+		    run->size > SLAB_MAX || run->size % ALIGN_SIZE != 0 ||
+		    run->nfree > run->nobjs || run->bump < RUN_OBJS(run) ||
+		    run->bump > RUN_OBJS(run) + run->nobjs * run->size)
+			printf("Error: slab run %p is corrupt!\n", bp);
+	}
+}
+
+/*
+ * Requires:
+ *   "index" is a size class, or SEGSIZE for the tree.
+ *
+ * Effects:
+ *   Perform a check on "bp", which should be a free block of the heap of
+ *   "ar" that is linked into class "index".  Returns true if "bp" is a
+ *   free block, so that its links can be followed, and false otherwise.
+ */
+static bool
+checkfree(struct mm_arena *ar, void *bp, int index)
+{
+	struct block_list *fp = bp, *prev, *next;
+	char *hi = (char *)mem_arena_hi(ar->id) + 1;
+	size_t size;
+
+	/* Check that "bp" is a free block before looking inside it. */
+	if ((char *)bp <= ar->heap_listp || (char *)bp >= hi ||
+	    (uintptr_t)bp % ALIGN_SIZE) {
+		printf("Error: free block %p is outside the heap!\n", bp);
+		return (false);
+	}
+	size = GET_SIZE(HDRP(bp));
+	if (GET_ALLOC(HDRP(bp)) || size < 2 * DSIZE || (char *)bp + size > hi) {
+		printf("Error: %p in free class %d is not free!\n", bp, index);
+		return (false);
+	}
+
+	/* Check if a free block's header matches with its footer. */
+	if (GET_SIZE(FTRP(bp)) != size || GET_ALLOC(FTRP(bp)))
+		printf("Error: header of %p does not match footer!\n", bp);
+
+	if (index == SEGSIZE) {
+		checktree(ar, bp);
+		return (true);
+	}
+
+	/* Check that the block is in the class for its size. */
+	if (size >= TREE_MIN || seg_index(size) != index)
+		printf("Error: %p of size %zu is in free class %d!\n", bp, size,
+		    index);
+
+	/* Check that its neighbors in the class link back to it. */
+	prev = PREV_LIST(fp);
+	next = NEXT_LIST(fp);
+	if ((prev == NULL ? ar->segs.seg_first[index] != fp :
+	    NEXT_LIST(prev) != fp) || (next != NULL && PREV_LIST(next) != fp))
+		printf("Error: %p is not linked into free class %d!\n", bp,
+		    index);
+	if (fit_policy == MM_FIT_ADDRESS && next != NULL && next < fp)
+		printf("Error: free class %d is out of address order at %p!\n",
+		    index, bp);
+	return (true);
+}
+
+/* 
+ * Requires:
+ *   "budget" is positive.
+ *
+ * Effects:
+ *   Perform a check of the heap of "ar" for consistency, a step at a time.
+ *   Each step checks up to "budget" blocks, continuing the walk of the heap
+ *   from where the last step stopped, and up to "budget" free blocks,
+ *   continuing the walk of the size classes and then the tree.  Either walk
+ *   ends at most once per step, at the end of the heap or of the tree, so
+ *   a "budget" larger than the heap checks it exactly once.
+ */
+static void
+checkheap(struct mm_arena *ar, unsigned int budget, bool verbose) 
+{	
+	struct block_list *fp;
+	unsigned int n;
+	int index;
+	char *bp, *hi = (char *)mem_arena_hi(ar->id) + 1;
+
+	if (verbose && ar->check_bp == NULL) {
+		printf("\n----New Checkheap----\n");
+		printf("Heap (%p):\n", ar->heap_listp);
+	}
+
+	/* Walk the heap, starting over after the epilogue. */
+	bp = (ar->check_bp != NULL) ? ar->check_bp : ar->heap_listp;
+	for (n = 0; n < budget && bp != NULL; n++) {
+		if (verbose)
+			printblock(ar, bp);
+		if (GET_SIZE(HDRP(bp)) == 0) {
+			/* Check epilogue. */
+			if (bp != hi || !GET_ALLOC(HDRP(bp)))
+				printf("Error: bad epilogue header!\n");
+			bp = NULL;
+		} else if (NEXT_BLKP(bp) > hi) {
+			printf("Error: %p runs past the end of the heap!\n", bp);
+			bp = NULL;
+		} else {
+			checkblock(ar, bp);
+			bp = NEXT_BLKP(bp);
 		}
-		printf("Error: %p not in free ist at index %u at size %zu \n", 
-		    bp, index, GET_SIZE(HDRP(bp)));
-	} else {
-		/* Check that non free blocks aren't in any free lists. */
-		while (i != NULL) {
-			if (i == bp) {
-				printf("Found non-free block %p", bp);
-				return;
+	}
+	ar->check_bp = bp;
+
+	/*
+	 * Walk the free blocks of each class in turn, and then the tree.  A
+	 * class is taken up by checking its record in the bitmaps.
+	 */
+	fp = ar->check_fp;
+	index = ar->check_index;
+	for (n = 0; n < budget; n++) {
+		if (fp == NULL) {
+			if (index == SEGSIZE)
+				fp = (struct block_list *)tree_find(ar, 0);
+			else {
+				fp = ar->segs.seg_first[index];
+				if ((fp != NULL) != ((ar->segs.sl_bitmap[index /
+				    SL_COUNT] >> (index % SL_COUNT) & 1) != 0) ||
+				    (ar->segs.sl_bitmap[index / SL_COUNT] != 0) !=
+				    ((ar->segs.fl_bitmap >> (index / SL_COUNT) &
+				    1) != 0))
+					printf("Error: bitmaps disagree with "
+					    "free class %d!\n", index);
 			}
-			if (i == NULL || i->next_list == NULL) 
+		} else {
+			if (verbose)
+				printf("Block %p in free class %d\n", fp, index);
+			if (!checkfree(ar, fp, index))
+				fp = NULL;
+			else if (index == SEGSIZE)
+				fp = (struct block_list *)tree_next(
+				    (struct tree_node *)fp);
+			else
+				fp = NEXT_LIST(fp);
+		}
+		if (fp == NULL) {
+			/* Go on to the next class, ending the step at the end. */
+			if (index++ == SEGSIZE) {
+				index = 0;
 				break;
-			i = i->next_list;
+			}
 		}
 	}
+	ar->check_fp = fp;
+	ar->check_index = index;
 }
 
-/* 
+/*
+ * Requires:
+ *   "np" is the address of a free block of at least TREE_MIN bytes.
+ *
+ * Effects:
+ *   Perform a check on "np" as a node of the tree: that its parent and
+ *   children link to it, that it orders between its children, and that it
+ *   is not red with a red child.
+ */
+static void
+checktree(struct mm_arena *ar, struct tree_node *np)
+{
+	struct tree_node *child;
+	int dir;
+
+	if (GET_SIZE(HDRP(np)) < TREE_MIN)
+		printf("Error: %p is too small for the tree!\n", np);
+	if (np->parent == NULL ? ar->segs.tree_root != np :
+	    np->parent->child[0] != np && np->parent->child[1] != np)
+		printf("Error: %p is not linked into the tree!\n", np);
+	if (np->parent == NULL && np->red)
+		printf("Error: tree root %p is red!\n", np);
+	for (dir = 0; dir < 2; dir++) {
+		if ((child = np->child[dir]) == NULL)
+			continue;
+		if (child->parent != np || TREE_LESS(child, np) != (dir == 0))
+			printf("Error: %p is misplaced under %p in the tree!\n",
+			    child, np);
+		if (np->red && child->red)
+			printf("Error: red %p has a red child!\n", np);
+	}
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a block.
+ *
+ * Effects:
+ *   Print the block "bp".
+ */
+static void
+printblock(struct mm_arena *ar, void *bp) 
+{
+	size_t hsize, fsize;
+	bool halloc, falloc;
+
+	hsize = GET_SIZE(HDRP(bp));
+	halloc = GET_ALLOC(HDRP(bp));  
+
+	if (hsize == 0) {
+		printf("%p: end of heap\n", bp);
+		return;
+	}
+	if (halloc) {
+		printf("%p: header: [%zu:a]%s\n", bp, hsize,
+		    slab_run_of(ar, bp) != NULL ? " slab run" : "");
+		return;
+	}
+	fsize = GET_SIZE(FTRP(bp));
+	falloc = GET_ALLOC(FTRP(bp));  
+
+	printf("%p: header: [%zu:%c] footer: [%zu:%c]\n", bp, 
+	    hsize, (halloc ? 'a' : 'f'), 
+	    fsize, (falloc ? 'a' : 'f'));
+}
+
+#ifdef MM_HARDEN
+/*
+ * Requires:
+ *   "link" is an encoded free list link.
+ *
+ * Effects:
+ *   Returns the block list that "link" encodes, or aborts if that is
+ *   neither NULL nor an aligned address within the heaps.
+ */
+inline static struct block_list *
+link_decode(struct block_list *link)
+{
+	char *np = (char *)((uintptr_t)link ^ harden_key);
+
+	if (np != NULL && (np < link_lo || np >= link_hi ||
+	    (uintptr_t)np % ALIGN_SIZE != 0))
+		harden_fail("free list link", np);
+	return ((struct block_list *)np);
+}
+
+/*
+ * Requires:
+ *   "ar" is arena_of("bp"), and "op" names the caller.
+ *
+ * Effects:
+ *   Aborts unless "bp" looks like a block that the allocator handed out:
+ *   either the start of an object in a slab run, or a block whose header
+ *   is marked allocated and holds the canary for its address.
+ */
+static void
+harden_check(struct mm_arena *ar, void *bp, const char *op)
+{
+	struct slab_run *run;
+	size_t offset;
+
+	if (ar != NULL && (run = slab_run_of(ar, bp)) != NULL) {
+		offset = (size_t)((char *)bp - RUN_OBJS(run));
+		if ((char *)bp >= RUN_OBJS(run) && (char *)bp < run->bump &&
+		    offset % run->size == 0)
+			return;
+	} else if (GET_ALLOC(HDRP(bp)) &&
+	    (GET(HDRP(bp)) & ~(word_t)UINT32_MAX) == CANARY(bp))
+		return;
+	harden_fail(op, bp);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Reports that "what" found the corrupt or invalid block "bp", and
+ *   aborts.
+ */
+static void
+harden_fail(const char *what, void *bp)
+{
+	fprintf(stderr, "%s: corrupt or invalid block %p\n", what, bp);
+	abort();
+}
+#endif
+
+/*
+ * Requires:
+ *   "size" is the size bytes to locate index of seg_first.
+ *
+ * Effects:
+ *   Returns the index of the size class holding blocks of "size" bytes.
+ */
+inline static int 
+seg_index(size_t size) 
+{
+	int fl, sl, msb;
+
+	/* Sizes below 2^FL_SHIFT are split linearly on first level 0. */
+	if (size < ((size_t)1 << FL_SHIFT))
+		return ((int)(size / ALIGN_SIZE));
+
+	/* Otherwise, the most significant bit selects the first level. */
+	msb = (int)(sizeof(size_t) * 8) - 1 - __builtin_clzl(size);
+	fl = msb - FL_SHIFT + 1;
+	if (fl >= FL_COUNT)
+		return (SEGSIZE - 1);
+
+	/* The SL_LOG2 bits below it select the second level. */
+	sl = (int)(size >> (msb - SL_LOG2)) & (SL_COUNT - 1);
+	return (fl * SL_COUNT + sl);
+}
+
+/*
  * Requires:
- *   None.
+ *   "index" is the index of a size class.
  *
  * Effects:
- *   Perform a check of the heap for consistency. 
+ *   Returns the smallest size of a block in size class "index", the
+ *   inverse of seg_index.
  */
-void
-checkheap(bool verbose) 
-{	
-	void *bp;
-	char* current;
-	char* next;
-        char* start;
-	current = heap_listp;
-	start = heap_listp;
-	next = NEXT_BLKP(start);
-	size_t hsize, halloc, fsize, falloc;
-   	hsize = GET_SIZE(HDRP(bp));
-    	halloc = GET_ALLOC(HDRP(bp));
-    	fsize = GET_SIZE(FTRP(bp));
-    	falloc = GET_ALLOC(FTRP(bp));
-
-	// Check if any contiguous free blocks that somehow escaped coalescing.
-
-	while (start != next) {
-		if (GET_ALLOC(current) && !GET_ALLOC(next)) 
-			printf("Adjacent blocks are free and uncoalesced! \n");
-		current = next;
-		next = NEXT_BLKP(next);
-	}
-
-	/* 
-	 * Checks if the header and footer of a block given as input is 
-	 * consistent. Runs silently unless there is a mismatch between 
-	 * header and footer.
-	 */
-    	if(hsize!=fsize ||(falloc!=halloc))
-        	printf("\n Inconsistent header & footer. Recheck block %p\n",
-		    bp);
-	
-	if (verbose) {
-		printf("\n----New Checkheap----\n");
-		printf("Heap (%p):\n", heap_listp);
-	}
-
-	// Check prologue.
-	if (GET_SIZE(HDRP(heap_listp)) != DSIZE || 
-	    !GET_ALLOC(HDRP(heap_listp)))
-		printf("Bad prologue header!\n");
-	checkblock(heap_listp);
-
-	// Check epilogue.
-	if (verbose)
-		printblock(bp);
-	if (GET_SIZE(HDRP(bp)) != 0 || !GET_ALLOC(HDRP(bp)))
-		printf("Bad epilogue header!\n");
-	
-	// Check if every block in the free list marked as free.
-	for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-		if (verbose)
-			printblock(bp);
-		checkblock(bp);
-	}
+static size_t
+seg_min_size(int index)
+{
+	int fl = index / SL_COUNT, sl = index % SL_COUNT, msb;
 
-	/*
-	 * Check if every free block actually in the free list.
-	 * Print entire free list.
-	 */ 
-	if (verbose) {
-		struct block_list *head = seg_first;
-		for (struct block_list *head = seg_first; 
-		    head != NULL; head = head->next_list) {
-			printf("Mistake here on %p", head);
-			return;
-		}
-		printf("Block %p in free list index", head);
-		printf(" %zu with allocation",GET_SIZE(HDRP(head)));
-		printf(" %c\n", GET_ALLOC(HDRP(head)) ? 'a' : 'f');
-	}
-		
+	if (fl == 0)
+		return ((size_t)index * ALIGN_SIZE);
+	msb = fl + FL_SHIFT - 1;
+	return (((size_t)1 << msb) + ((size_t)sl << (msb - SL_LOG2)));
 }
 
 /*
  * Requires:
- *   "bp" is the address of a block.
+ *   The lock of "ar" is held.
  *
  * Effects:
- *   Print the block "bp".
+ *   Add the heap, the free blocks and the counts of events of "ar" to
+ *   "st".
  */
 static void
-printblock(void *bp) 
+arena_stats(struct mm_arena *ar, struct mm_stats *st)
 {
-	size_t hsize, fsize;
-	bool halloc, falloc;
-
-	checkheap(false);
-	hsize = GET_SIZE(HDRP(bp));
-	halloc = GET_ALLOC(HDRP(bp));  
-	fsize = GET_SIZE(FTRP(bp));
-	falloc = GET_ALLOC(FTRP(bp));  
-
-	if (hsize == 0) {
-		printf("%p: end of heap\n", bp);
-		return;
+	struct block_list *fp;
+	struct tree_node *np;
+	int index;
+
+	st->heap_bytes += mem_arena_heapsize(ar->id);
+	st->binned_bytes += ar->quick_bytes;
+	st->splits += ar->stat_splits;
+	st->coalesces += ar->stat_coalesces;
+	st->fits += ar->stat_fits;
+	st->fit_probes += ar->stat_probes;
+	st->rounded += ar->stat_rounded;
+	st->round_bytes += ar->stat_round_bytes;
+
+	for (index = 0; index < SEGSIZE; index++) {
+		for (fp = ar->segs.seg_first[index]; fp != NULL;
+		    fp = NEXT_LIST(fp))
+			stats_block(st, index, GET_SIZE(HDRP(fp)));
 	}
+	for (np = tree_find(ar, 0); np != NULL; np = tree_next(np))
+		stats_block(st, SEGSIZE, GET_SIZE(HDRP(np)));
+}
 
-	printf("%p: header: [%zu:%c] footer: [%zu:%c]\n", bp, 
-	    hsize, (halloc ? 'a' : 'f'), 
-	    fsize, (falloc ? 'a' : 'f'));
+/*
+ * Requires:
+ *   "index" is a size class, or SEGSIZE for the tree.
+ *
+ * Effects:
+ *   Add a free block of "size" bytes in "index" to "st".
+ */
+static void
+stats_block(struct mm_stats *st, int index, size_t size)
+{
+	st->free_bytes += size;
+	st->free_blocks++;
+	st->class_bytes[index] += size;
+	st->class_blocks[index]++;
+	if (size > st->largest_free)
+		st->largest_free = size;
 }
 
 /*
  * Requires:
- *   "size" is the size bytes to locate index of seg_first.
+ *   "index" is the index of a size class.
  *
  * Effects:
- *   Returns the index of seg_first.
+ *   Returns the index of the smallest nonempty size class above "index", or
+ *   -1 if there is none.
  */
-inline static int 
-seg_index(size_t size) 
+inline static int
+seg_next_nonempty(struct mm_arena *ar, int index)
 {
-	/* Depending on size, locate index 0-9. */
-	if (size <= 32) 			
-		return (0);
-	else if (size <= 64) 	
-		return (1);
-	else if (size <= 128) 	
-		return (2);
-	else if (size <= 256) 	
-		return (3);
-	else if (size <= 512) 	
-		return (4);
-	else if (size <= 1024) 	
-		return (5);
-	else if (size <= 2048) 	
-		return (6);
-	else if (size <= 4096) 	
-		return (7);
-	else if (size <= 8192) 	
-		return (8);
-	else  						
-		return (9);
-	
+	struct seg_table *segs = &ar->segs;
+	int fl = index / SL_COUNT;
+	int sl = index % SL_COUNT;
+	uint32_t map;
+
+	/* Look for a larger nonempty class on the same first level. */
+	map = segs->sl_bitmap[fl] & (~(uint32_t)0 << (sl + 1)) &
+	    ((1U << SL_COUNT) - 1);
+	if (map != 0)
+		return (fl * SL_COUNT + __builtin_ctz(map));
+
+	/* Otherwise, take the smallest class on the next nonempty level. */
+	if (fl + 1 >= FL_COUNT)
+		return (-1);
+	map = segs->fl_bitmap & (~(uint32_t)0 << (fl + 1));
+	if (map == 0)
+		return (-1);
+	fl = __builtin_ctz(map);
+	return (fl * SL_COUNT + __builtin_ctz(segs->sl_bitmap[fl]));
 }
 
 /* 
@@ -603,40 +2920,90 @@ seg_index(size_t size)
  *    locate index using seg_index function.
  * 
  * Effects:
- *    Insert "bp" to corresponding place in seg_first.
+ *    Insert "bp" to corresponding place in seg_first, or in the tree.
  */
 inline static void
-list_insert(struct block_list *bp, size_t size)
+list_insert(struct mm_arena *ar, struct block_list *bp, size_t size)
 {
-	/* Get the supposed previous and next block_list of bp. */
-	struct block_list *start = &seg_first[seg_index(size)];
-	struct block_list *new_after = start->next_list;
+	struct seg_table *segs = &ar->segs;
+	int index = seg_index(size);
+	struct block_list *new_after = segs->seg_first[index];
+	struct block_list *new_before = NULL;
+
+	/* Large blocks go in the tree instead. */
+	if (size >= TREE_MIN) {
+		tree_insert(ar, (struct tree_node *)bp);
+		return;
+	}
 
-	/* Perform bp insertion. */
-	bp->prev_list = start;
-	bp->next_list = new_after;
-	new_after->prev_list = bp;
-	start->next_list = bp;
+	/* Address-ordered classes insert bp before the first block above it. */
+	if (fit_policy == MM_FIT_ADDRESS) {
+		while (new_after != NULL && new_after < bp) {
+			new_before = new_after;
+			new_after = NEXT_LIST(new_after);
+		}
+	}
+
+	/* Perform bp insertion, at the front of its class by default. */
+	SET_PREV_LIST(bp, new_before);
+	SET_NEXT_LIST(bp, new_after);
+	if (new_after != NULL)
+		SET_PREV_LIST(new_after, bp);
+	if (new_before != NULL)
+		SET_NEXT_LIST(new_before, bp);
+	else
+		segs->seg_first[index] = bp;
+
+	/* Mark the class nonempty. */
+	segs->fl_bitmap |= 1U << (index / SL_COUNT);
+	segs->sl_bitmap[index / SL_COUNT] |= 1U << (index % SL_COUNT);
 }
 
 /* 
  * Requires:
- *    "bp" is the address of removed block.
+ *    "bp" is the address of removed block, and its header still holds the
+ *    size that it was inserted with.
  * 
  * Effects:
- *    Remove "bp" from seg_first.
+ *    Remove "bp" from seg_first, or from the tree.
  */
 inline static void
-list_remove(struct block_list *bp)
+list_remove(struct mm_arena *ar, struct block_list *bp)
 {
+	struct seg_table *segs = &ar->segs;
+	struct block_list *new_prev, *new_next;
+	int index;
+
+	/* The checker starts its class over if it was to visit bp next. */
+	if (ar->check_fp == bp)
+		ar->check_fp = NULL;
+
+	if (GET_SIZE(HDRP(bp)) >= TREE_MIN) {
+		tree_remove(ar, (struct tree_node *)bp);
+		return;
+	}
+
 	/* Get the previous and next block_list of bp. */
-	struct block_list *new_prev = bp->prev_list;
-	struct block_list *new_next = bp->next_list;
+	new_prev = PREV_LIST(bp);
+	new_next = NEXT_LIST(bp);
 
 	/* Perform bp removal. */
-	new_prev->next_list = new_next;
-	new_next->prev_list = new_prev;
-	
+	if (new_next != NULL)
+		SET_PREV_LIST(new_next, new_prev);
+	if (new_prev != NULL) {
+		SET_NEXT_LIST(new_prev, new_next);
+		return;
+	}
+
+	/* Bp was first in its class, so the class may now be empty. */
+	index = seg_index(GET_SIZE(HDRP(bp)));
+	segs->seg_first[index] = new_next;
+	if (new_next == NULL) {
+		segs->sl_bitmap[index / SL_COUNT] &= 
+		    ~(1U << (index % SL_COUNT));
+		if (segs->sl_bitmap[index / SL_COUNT] == 0)
+			segs->fl_bitmap &= ~(1U << (index / SL_COUNT));
+	}
 }
 
 /*
@@ -661,3 +3028,451 @@ next_power_of_2(size_t n)
 	n++;           
 	return (n);
 }
+
+/*
+ * Requires:
+ *   "align" is a power of two that is a multiple of ALIGN_SIZE.
+ *
+ * Effects:
+ *   Returns the distance from the block "bp" to the first "align"-aligned
+ *   address at which a block can start, leaving either nothing or a free
+ *   block of at least the minimum size in front of it.
+ */
+inline static size_t
+aligned_gap(void *bp, size_t align)
+{
+	size_t gap = (align - (uintptr_t)bp % align) % align;
+
+	while (gap != 0 && gap < 2 * DSIZE)
+		gap += align;
+	return (gap);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block or object in "ar".
+ *
+ * Effects:
+ *   Returns true if mm_free_batch should return "bp" to the heap itself,
+ *   and false if "bp" belongs to a slab run, a thread cache, or another
+ *   thread's arena.
+ */
+inline static bool
+batch_heap_block(struct mm_arena *ar, void *bp)
+{
+	if (slab_run_of(ar, bp) != NULL)
+		return (false);
+#ifdef MM_THREADS
+	if (GET_SIZE(HDRP(bp)) <= TCACHE_MAX || arena_slot != ar->id + 1)
+		return (false);
+#endif
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "a" and "b" point to pointers.
+ *
+ * Effects:
+ *   Compares the pointers for qsort, ordering them by address.
+ */
+static int
+ptr_compare(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)*(void *const *)a;
+	uintptr_t y = (uintptr_t)*(void *const *)b;
+
+	return ((x > y) - (x < y));
+}
+
+#ifdef MM_THREADS
+/*
+ * The remaining routines manage the per-thread caches.
+ */
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the calling thread's cache, emptying it first if it was filled
+ *   from a heap that mm_init has since replaced.
+ */
+static struct tcache *
+tcache_get(void)
+{
+	struct tcache *tc = &tcache;
+	unsigned long gen = __atomic_load_n(&heap_gen, __ATOMIC_ACQUIRE);
+
+	if (tc->gen != gen) {
+		/* The old blocks belonged to the old heap; just forget them. */
+		memset(tc->count, 0, sizeof(tc->count));
+		memset(tc->bins, 0, sizeof(tc->bins));
+		tc->bytes = tc->freed = 0;
+		tc->gen = gen;
+	}
+	return (tc);
+}
+
+/*
+ * Requires:
+ *   "ar" is the calling thread's arena, and "bin" is a thread cache bin.
+ *
+ * Effects:
+ *   Allocate a block or slab object for "bin", from the calling thread's
+ *   cache if it holds one and from "ar" otherwise.  Returns its address if
+ *   the allocation was successful and NULL otherwise.
+ */
+static void *
+tcache_malloc(struct mm_arena *ar, int bin)
+{
+	struct tcache *tc = tcache_get();
+	struct block_list *bp;
+
+	if ((bp = tc->bins[bin]) != NULL) {
+		tc->bins[bin] = NEXT_LIST(bp);
+		tc->count[bin]--;
+		tc->bytes -= TCACHE_SIZE(bin);
+		return (bp);
+	}
+	return (tcache_refill(tc, ar, bin));
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block or slab object that belongs
+ *   in the thread cache bin "bin".
+ *
+ * Effects:
+ *   Free "bp" into the calling thread's cache, flushing part of the bin to
+ *   the heap if it is full, and all of it if the cache is over budget.
+ */
+static void
+tcache_free(int bin, void *bp)
+{
+	struct tcache *tc = tcache_get();
+
+	SET_NEXT_LIST((struct block_list *)bp, tc->bins[bin]);
+	tc->bins[bin] = bp;
+	tc->bytes += TCACHE_SIZE(bin);
+	tc->freed += TCACHE_SIZE(bin);
+	if (++tc->count[bin] > (unsigned int)TCACHE_BIN_CAP(bin))
+		tcache_flush(tc, bin, TCACHE_BIN_FILL(bin));
+	else if (tc->bytes > TCACHE_BUDGET)
+		tcache_flush(tc, bin, tc->count[bin]);
+}
+
+/*
+ * Requires:
+ *   "tc" is the calling thread's cache, and its bin "bin" is empty.  "ar"
+ *   is the calling thread's arena.
+ *
+ * Effects:
+ *   Allocate up to TCACHE_FILL blocks or slab objects for "bin" from "ar"
+ *   under a single acquisition of its lock, extending the heap for at most
+ *   the first.  Returns one of them and keeps the rest in "tc".  Returns
+ *   NULL if none could be allocated.
+ */
+static void *
+tcache_refill(struct tcache *tc, struct mm_arena *ar, int bin)
+{
+	struct block_list *bp, *first;
+	int i;
+
+	HEAP_LOCK(ar);
+	remote_drain(ar);
+	ar->stat_rounded += tc->rounded;
+	ar->stat_round_bytes += tc->round_bytes;
+	tc->rounded = tc->round_bytes = 0;
+	for (first = NULL, i = 0; i < TCACHE_BIN_FILL(bin); i++) {
+		/* Only the first block may grow the heap or take a new run. */
+		if (bin < SLAB_CLASSES)
+			bp = (i == 0 || ar->slab_partial[bin] != NULL) ?
+			    slab_malloc(ar, SLAB_SIZE(bin)) : NULL;
+		else if (i == 0)
+			bp = heap_malloc(ar, TCACHE_SIZE(bin));
+		else if ((bp = find_fit(ar, TCACHE_SIZE(bin))) != NULL)
+			place(ar, bp, TCACHE_SIZE(bin));
+		if (bp == NULL)
+			break;
+		if (first == NULL)
+			first = bp;
+		else {
+			SET_NEXT_LIST(bp, tc->bins[bin]);
+			tc->bins[bin] = bp;
+			tc->count[bin]++;
+			tc->bytes += TCACHE_SIZE(bin);
+		}
+	}
+	CHECK_SAMPLE(ar);
+	HEAP_UNLOCK(ar);
+	return (first);
+}
+
+/*
+ * Requires:
+ *   "tc" is the calling thread's cache, and "bin" is one of its bins.
+ *
+ * Effects:
+ *   Return up to "n" blocks from "bin" to their heaps.  Consecutive blocks
+ *   from the same arena are freed under a single acquisition of its lock.
+ */
+static void
+tcache_flush(struct tcache *tc, int bin, unsigned int n)
+{
+	struct block_list *bp;
+	struct mm_arena *ar = NULL, *owner;
+	struct slab_run *run;
+
+	while (n-- > 0 && (bp = tc->bins[bin]) != NULL) {
+		tc->bins[bin] = NEXT_LIST(bp);
+		tc->count[bin]--;
+		tc->bytes -= TCACHE_SIZE(bin);
+		if ((owner = arena_of(bp)) != ar) {
+			if (ar != NULL)
+				HEAP_UNLOCK(ar);
+			ar = owner;
+			HEAP_LOCK(ar);
+		}
+		if ((run = slab_run_of(ar, bp)) != NULL)
+			slab_free(ar, run, bp);
+		else
+			heap_free(ar, bp);
+	}
+	if (ar != NULL) {
+		CHECK_SAMPLE(ar);
+		HEAP_UNLOCK(ar);
+	}
+}
+
+/*
+ * Requires:
+ *   The lock of "ar" is held.
+ *
+ * Effects:
+ *   Return every block in the calling thread's cache that belongs to "ar"
+ *   to its heap, so that the blocks can be coalesced, unless nothing has
+ *   been freed into the cache since the last return.  Blocks that were
+ *   only ever refilled came from the free lists as they are.  Returns true
+ *   if any block was returned and false otherwise.
+ */
+static bool
+tcache_return(struct mm_arena *ar)
+{
+	struct tcache *tc = tcache_get();
+	struct block_list *bp, *next;
+	struct slab_run *run;
+	bool returned = false;
+	int bin;
+
+	if (tc->freed == 0)
+		return (false);
+	tc->freed = 0;
+	for (bin = 0; tc->bytes > 0 && bin < TCACHE_BINS; bin++) {
+		/* Take the whole bin first, as heap_free may call back here. */
+		bp = tc->bins[bin];
+		tc->bins[bin] = NULL;
+		tc->bytes -= tc->count[bin] * TCACHE_SIZE(bin);
+		tc->count[bin] = 0;
+		for (; bp != NULL; bp = next) {
+			next = NEXT_LIST(bp);
+			if (arena_of(bp) != ar) {
+				SET_NEXT_LIST(bp, tc->bins[bin]);
+				tc->bins[bin] = bp;
+				tc->count[bin]++;
+				tc->bytes += TCACHE_SIZE(bin);
+				continue;
+			}
+			if ((run = slab_run_of(ar, bp)) != NULL)
+				slab_free(ar, run, bp);
+			else
+				heap_free(ar, bp);
+			returned = true;
+		}
+	}
+	return (returned);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Create the key whose destructor flushes a thread's cache, and
+ *   uncounts the thread from its arena, when the thread exits.
+ */
+static void
+tcache_key_create(void)
+{
+	pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * Requires:
+ *   "arg" is the cache of an exiting thread.
+ *
+ * Effects:
+ *   Return every block in the cache "arg" to the heap, unless the heap has
+ *   been replaced since the cache was filled.  Then uncount the exiting
+ *   thread from its arena, and drain the arena's remote stack if no thread
+ *   is left to do so.
+ */
+static void
+tcache_destroy(void *arg)
+{
+	struct tcache *tc = arg;
+	struct mm_arena *ar;
+	int bin, id = arena_slot - 1;
+
+	if (tc->gen == __atomic_load_n(&heap_gen, __ATOMIC_ACQUIRE)) {
+		for (bin = 0; bin < TCACHE_BINS; bin++) {
+			if (tc->count[bin] > 0)
+				tcache_flush(tc, bin, tc->count[bin]);
+		}
+	}
+
+	/*
+	 * Pairs with the fence in remote_free: either this drain sees its
+	 * push, or it sees no thread left, and drains the stack itself.
+	 */
+	arena_slot = 0;
+	if (__atomic_sub_fetch(&arena_threads[id], 1, __ATOMIC_SEQ_CST) > 0)
+		return;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ((ar = __atomic_load_n(&arenas[id], __ATOMIC_ACQUIRE)) != NULL) {
+		HEAP_LOCK(ar);
+		remote_drain(ar);
+		HEAP_UNLOCK(ar);
+	}
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block or slab object in "ar", and
+ *   the calling thread is not assigned to "ar".
+ *
+ * Effects:
+ *   Push "bp" onto the remote stack of "ar", without taking its lock, for
+ *   one of the arena's own threads to free.  If the arena has no threads
+ *   left, drain the stack under its lock instead, as no one else will.
+ */
+static void
+remote_free(struct mm_arena *ar, void *bp)
+{
+	struct block_list *fp = bp;
+	struct block_list *head = __atomic_load_n(&ar->remote,
+	    __ATOMIC_RELAXED);
+
+	do
+		SET_NEXT_LIST(fp, head);
+	while (!__atomic_compare_exchange_n(&ar->remote, &head, fp, true,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* Pairs with the fence in tcache_destroy. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&arena_threads[ar->id], __ATOMIC_RELAXED) == 0) {
+		HEAP_LOCK(ar);
+		remote_drain(ar);
+		HEAP_UNLOCK(ar);
+	}
+}
+
+/*
+ * Requires:
+ *   The lock of "ar" is held.
+ *
+ * Effects:
+ *   Free every block and slab object on the remote stack of "ar".  The
+ *   whole stack is taken at once, so pushes never wait on the drain.
+ */
+static void
+remote_drain(struct mm_arena *ar)
+{
+	struct block_list *fp, *next;
+	struct slab_run *run;
+
+	if (__atomic_load_n(&ar->remote, __ATOMIC_RELAXED) == NULL)
+		return;
+	fp = __atomic_exchange_n(&ar->remote, NULL, __ATOMIC_ACQUIRE);
+	for (; fp != NULL; fp = next) {
+		next = NEXT_LIST(fp);
+		if ((run = slab_run_of(ar, fp)) != NULL)
+			slab_free(ar, run, fp);
+		else
+			heap_free(ar, fp);
+	}
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Install the handlers that hold every lock across fork(), so that the
+ *   child's only thread does not inherit a lock held by a thread that the
+ *   child lacks.
+ */
+static void
+fork_register(void)
+{
+	pthread_atfork(fork_prepare, fork_release, fork_child);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Take every lock.  No other routine holds two of them at once, so
+ *   this order cannot deadlock.
+ */
+static void
+fork_prepare(void)
+{
+	int i;
+
+	pthread_mutex_lock(&arena_init_lock);
+	MAP_LOCK();
+	for (i = 0; i < MM_ARENAS; i++) {
+		if (arenas[i] != NULL)
+			HEAP_LOCK(arenas[i]);
+	}
+}
+
+/*
+ * Requires:
+ *   fork_prepare has taken every lock.
+ *
+ * Effects:
+ *   Release every lock, in the parent after fork() or for fork_child.
+ */
+static void
+fork_release(void)
+{
+	int i;
+
+	for (i = MM_ARENAS - 1; i >= 0; i--) {
+		if (arenas[i] != NULL)
+			HEAP_UNLOCK(arenas[i]);
+	}
+	MAP_UNLOCK();
+	pthread_mutex_unlock(&arena_init_lock);
+}
+
+/*
+ * Requires:
+ *   fork_prepare has taken every lock, and the caller is the child.
+ *
+ * Effects:
+ *   Count only the child's thread as assigned to an arena, since the
+ *   others did not survive the fork, and release every lock.
+ */
+static void
+fork_child(void)
+{
+	memset(arena_threads, 0, sizeof(arena_threads));
+	if (arena_slot != 0)
+		arena_threads[arena_slot - 1] = 1;
+	fork_release();
+}
+#endif
@@ -6,6 +6,82 @@ int	 mm_init(void);
 void	*mm_malloc(size_t size);
 void	 mm_free(void *ptr);
 void	*mm_realloc(void *ptr, size_t size);
+void	*mm_calloc(size_t nmemb, size_t size);
+size_t	 mm_malloc_batch(size_t size, size_t n, void **ptrs);
+void	 mm_free_batch(void **ptrs, size_t n);
+void	*mm_memalign(size_t alignment, size_t size);
+void	*mm_aligned_calloc(size_t alignment, size_t nmemb, size_t size);
+size_t	 mm_usable_size(void *ptr);
+int	 mm_mallopt(int param, int value);
+int	 mm_thread_safe(void);
+
+/*
+ * Statistics, for mm_stats(), summed over every heap.  Free blocks are kept
+ * in "classes" - 1 size classes by size, and then in a tree of large
+ * blocks, which is counted as the last class.  The number of classes
+ * depends on the build's profile, and is at most MM_STATS_CLASSES.  The
+ * counts of events start over at every mm_init().
+ */
+#define MM_STATS_CLASSES 385
+
+struct mm_stats {
+	int	classes;	/* Number of classes, the tree included */
+	size_t	heap_bytes;	/* Bytes in every heap */
+	size_t	free_bytes;	/* Bytes in free blocks */
+	size_t	free_blocks;	/* Number of free blocks */
+	size_t	largest_free;	/* Bytes in the largest free block */
+	size_t	binned_bytes;	/* Bytes freed but not yet coalesced */
+	size_t	class_min[MM_STATS_CLASSES];	/* Smallest block per class */
+	size_t	class_bytes[MM_STATS_CLASSES];	/* Free bytes per class */
+	size_t	class_blocks[MM_STATS_CLASSES];	/* Free blocks per class */
+	unsigned long splits;		/* Free blocks split to place a block */
+	unsigned long coalesces;	/* Free neighbors merged */
+	unsigned long fits;		/* Searches for a fitting free block */
+	unsigned long fit_probes;	/* Free blocks examined by them */
+	unsigned long rounded;		/* Requests rounded to a power of 2 */
+	unsigned long round_bytes;	/* Bytes added by that rounding */
+};
+
+void	 mm_stats(struct mm_stats *st);
+
+/*
+ * Regions, for objects that are all freed together.  A region must only be
+ * used by one thread at a time, and does not survive mm_init().
+ */
+struct mm_region;
+
+struct mm_region *mm_region_create(void);
+void	*mm_region_alloc(struct mm_region *rg, size_t size);
+void	 mm_region_destroy(struct mm_region *rg);
+
+/*
+ * Tunable parameters for mm_mallopt().
+ */
+#define MM_REALLOC_GROWTH 1 /* Percent of the requested size that realloc
+			       allocates when it has to move a block */
+#define MM_FIT_POLICY     2 /* Placement policy, one of the MM_FIT_* values;
+			       takes effect at the next mm_init() */
+#define MM_FIT_PROBES     3 /* Fitting blocks compared by MM_FIT_BEST */
+#define MM_MMAP_THRESHOLD 4 /* Smallest request, in bytes, given a region of
+			       its own instead of a place in the heap */
+#define MM_TRIM_THRESHOLD 5 /* Largest free block, in bytes, left at the end
+			       of a heap before the heap is shrunk, or
+			       negative to never shrink the heap */
+#define MM_DEFER_COALESCE 6 /* If nonzero, small freed blocks are kept for
+			       reuse and only coalesced in batches */
+#define MM_NUMA           7 /* If nonzero, each arena is bound to a NUMA
+			       node and threads use the arenas of their own
+			       node; takes effect at the next mm_init() */
+#define MM_CHECK_INTERVAL 8 /* If positive, every that many calls that reach
+			       a heap check a bounded part of it for
+			       consistency; zero (the default) never checks */
+
+/*
+ * Placement policies for MM_FIT_POLICY.
+ */
+#define MM_FIT_FIRST      0 /* First fit (the default) */
+#define MM_FIT_BEST       1 /* Best of the first MM_FIT_PROBES fits */
+#define MM_FIT_ADDRESS    2 /* Best fit, with free lists in address order */
 
 /*
  * Students work in teams of one or two.  Teams enter their team name, personal
@@ -0,0 +1,462 @@
+/*
+ * mmcapture.c - A preload library that captures a program's heap requests
+ *
+ * Usage:
+ *     LD_PRELOAD=./libmmcapture.so MMCAPTURE_FILE=<capture> <program> ...
+ *     cap2rep [-b] <capture> <trace>
+ *
+ * The library wraps malloc, calloc, realloc, free, and the aligned
+ * allocators of the C library.  Each request that succeeds is numbered
+ * from one global counter and recorded, by the address of its block, in
+ * a ring buffer that belongs to the calling thread.  Only that thread
+ * writes its ring and only a flusher thread, which wakes every
+ * FLUSH_NSEC, drains it into the capture file, so a request costs one
+ * atomic increment and a copy unless its ring is full.  cap2rep orders
+ * the records and gives the blocks the ids that mdriver expects.
+ *
+ * The capture file is named by MMCAPTURE_FILE, or else
+ * "mmcapture.<pid>.cap".  Requests made before the library is
+ * initialized, after it is finalized, or in a child after fork() are
+ * not captured, and cap2rep ignores those blocks.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+#define RING_SIZE  (1 << 12)  /* records in a ring, a power of two */
+#define FLUSH_NSEC 1000000    /* period of the flusher (ns) */
+#define BOOT_SIZE  (1 << 14)  /* bytes for requests made by dlsym() */
+#define BOOT_ALIGN 16         /* alignment of those blocks */
+
+/* A thread's ring of records */
+typedef struct ring {
+    uint64_t head;        /* records written, only by the owner */
+    uint64_t tail;        /* records flushed, only by the flusher */
+    struct ring *next;    /* next ring in the list of all rings */
+    int owned;            /* does a live thread write this ring? */
+    caprec_t recs[RING_SIZE];
+} ring_t;
+
+/* The allocator of the C library */
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+
+/* Blocks handed out while dlsym() looks up the allocator */
+static char boot_buf[BOOT_SIZE] __attribute__((aligned(BOOT_ALIGN)));
+static size_t boot_used;
+static int resolving;
+
+static int capturing;          /* are requests being recorded? */
+static int stopping;           /* should the flusher exit? */
+static int cap_fd = -1;        /* the capture file */
+static uint64_t cap_seq = 1;   /* number of the next request */
+static ring_t *rings;          /* every ring ever made */
+static pthread_t flusher;
+static pthread_key_t ring_key;
+
+/*
+ * Thread-local state uses the initial-exec model, because the default
+ * model may allocate the first time a thread touches it.  in_shim is set
+ * while the library itself allocates, and in the flusher.
+ */
+static __thread ring_t *my_ring __attribute__((tls_model("initial-exec")));
+static __thread int in_shim __attribute__((tls_model("initial-exec")));
+
+static void resolve(void);
+static void *boot_alloc(size_t size);
+static int is_boot(void *ptr);
+static uint64_t next_seq(int kind);
+static void record(uint64_t seq, void *ptr, size_t size, uint64_t link);
+static ring_t *get_ring(void);
+static void release_ring(void *arg);
+static void *flush_thread(void *arg);
+static void flush_ring(ring_t *r);
+static void flush_all(void);
+static void forked_child(void);
+
+/*
+ * capture_init - Open the capture file and start the flusher
+ */
+static void __attribute__((constructor)) capture_init(void)
+{
+    char name[64];
+    char *path;
+
+    resolve();
+    if ((path = getenv("MMCAPTURE_FILE")) == NULL) {
+	snprintf(name, sizeof(name), "mmcapture.%d.cap", (int)getpid());
+	path = name;
+    }
+    if ((cap_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+	fprintf(stderr, "mmcapture: Could not create %s: %s\n", path,
+		strerror(errno));
+	return;
+    }
+
+    in_shim = 1;
+    if (pthread_key_create(&ring_key, release_ring) != 0 ||
+	pthread_atfork(NULL, NULL, forked_child) != 0 ||
+	pthread_create(&flusher, NULL, flush_thread, NULL) != 0) {
+	fprintf(stderr, "mmcapture: Could not start the flusher\n");
+	close(cap_fd);
+	cap_fd = -1;
+	in_shim = 0;
+	return;
+    }
+    in_shim = 0;
+    __atomic_store_n(&capturing, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * capture_fini - Stop the flusher, and flush what it left behind
+ */
+static void __attribute__((destructor)) capture_fini(void)
+{
+    if (!__atomic_load_n(&capturing, __ATOMIC_ACQUIRE))
+	return;
+    __atomic_store_n(&capturing, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+    flush_all();
+    close(cap_fd);
+}
+
+/*
+ * The wrappers.  A block is recorded after it is allocated, and a free is
+ * numbered before the block is freed, so that a block's address is only
+ * ever reused after the request that gave it up.
+ */
+
+void *malloc(size_t size)
+{
+    void *ptr;
+
+    if (real_malloc == NULL) {
+	if (resolving)
+	    return boot_alloc(size);
+	resolve();
+    }
+    ptr = real_malloc(size);
+    if (ptr != NULL)
+	record(next_seq(CAP_ALLOC), ptr, size, 0);
+    return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    if (real_calloc == NULL) {
+	/* boot_buf is zeroed, and every boot block is new */
+	if (resolving)
+	    return (size != 0 && nmemb > SIZE_MAX / size) ? NULL :
+		boot_alloc(nmemb * size);
+	resolve();
+    }
+    ptr = real_calloc(nmemb, size);
+    if (ptr != NULL)
+	record(next_seq(CAP_ALLOC), ptr, nmemb * size, 0);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *newptr;
+    uint64_t seq;
+    size_t oldsize;
+
+    if (ptr == NULL)
+	return malloc(size);
+
+    /* A boot block moves into the C library's heap */
+    if (is_boot(ptr)) {
+	oldsize = *((size_t *)ptr - 1);
+	if ((newptr = malloc(size)) != NULL)
+	    memcpy(newptr, ptr, (oldsize < size) ? oldsize : size);
+	return newptr;
+    }
+
+    if (real_realloc == NULL)
+	resolve();
+    seq = next_seq(CAP_RELEASE);
+    newptr = real_realloc(ptr, size);
+    if (newptr != NULL) {
+	record(seq, ptr, 0, 0);
+	record(next_seq(CAP_REALLOC), newptr, size, seq);
+    } else if (size == 0) {
+	/* The C library freed the block */
+	record(seq - CAP_RELEASE + CAP_FREE, ptr, 0, 0);
+    }
+    return newptr;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || is_boot(ptr))
+	return;
+    if (real_free == NULL)
+	resolve();
+    record(next_seq(CAP_FREE), ptr, 0, 0);
+    real_free(ptr);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    int error;
+
+    if (real_posix_memalign == NULL)
+	resolve();
+    error = real_posix_memalign(memptr, alignment, size);
+    if (error == 0)
+	record(next_seq(CAP_ALLOC), *memptr, size, 0);
+    return error;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (real_aligned_alloc == NULL)
+	resolve();
+    ptr = real_aligned_alloc(alignment, size);
+    if (ptr != NULL)
+	record(next_seq(CAP_ALLOC), ptr, size, 0);
+    return ptr;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (real_memalign == NULL)
+	resolve();
+    ptr = real_memalign(alignment, size);
+    if (ptr != NULL)
+	record(next_seq(CAP_ALLOC), ptr, size, 0);
+    return ptr;
+}
+
+/*
+ * resolve - Look up the allocator of the C library.  dlsym() may itself
+ *     allocate, which boot_alloc() serves meanwhile.
+ */
+static void resolve(void)
+{
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    resolving = 0;
+    if (real_malloc == NULL || real_calloc == NULL ||
+	real_realloc == NULL || real_free == NULL) {
+	fprintf(stderr, "mmcapture: Could not find the C library's "
+		"allocator\n");
+	abort();
+    }
+}
+
+/*
+ * boot_alloc - Allocate a block from boot_buf, which is never freed.  The
+ *     size of the block is kept in the word before it for realloc().
+ */
+static void *boot_alloc(size_t size)
+{
+    size_t *bp;
+    size_t need;
+
+
+    if (size > BOOT_SIZE)
+	return NULL;
+    need = BOOT_ALIGN + ((size + BOOT_ALIGN - 1) & ~(size_t)(BOOT_ALIGN - 1));
+    if (need > BOOT_SIZE - boot_used)
+	return NULL;
+    bp = (size_t *)(boot_buf + boot_used + BOOT_ALIGN);
+    bp[-1] = size;
+    boot_used += need;
+    return bp;
+}
+
+/*
+ * is_boot - Was the block at ptr allocated by boot_alloc()?
+ */
+static int is_boot(void *ptr)
+{
+    return (char *)ptr >= boot_buf && (char *)ptr < boot_buf + BOOT_SIZE;
+}
+
+/*
+ * next_seq - Number a request of the given kind
+ */
+static uint64_t next_seq(int kind)
+{
+    uint64_t n = __atomic_fetch_add(&cap_seq, 1, __ATOMIC_RELAXED);
+
+    return (n << 2) | kind;
+}
+
+/*
+ * record - Append a record to the calling thread's ring, waiting for the
+ *     flusher if the ring is full
+ */
+static void record(uint64_t seq, void *ptr, size_t size, uint64_t link)
+{
+    ring_t *r;
+    caprec_t *rec;
+
+    if (in_shim || !__atomic_load_n(&capturing, __ATOMIC_ACQUIRE))
+	return;
+    if ((r = get_ring()) == NULL)
+	return;
+    while (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >=
+	   RING_SIZE)
+	sched_yield();
+
+    rec = &r->recs[r->head & (RING_SIZE - 1)];
+    rec->seq = seq;
+    rec->ptr = (uintptr_t)ptr;
+    rec->size = size;
+    rec->link = link;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * get_ring - Return the calling thread's ring, taking over the ring of a
+ *     thread that has exited if there is one, or else mapping a new one
+ */
+static ring_t *get_ring(void)
+{
+    ring_t *r;
+    int unowned;
+
+    if (my_ring != NULL)
+	return my_ring;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL;
+	 r = r->next) {
+	unowned = 0;
+	if (__atomic_compare_exchange_n(&r->owned, &unowned, 1, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	    break;
+    }
+    if (r == NULL) {
+	r = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r == MAP_FAILED)
+	    return NULL;
+	r->owned = 1;
+	r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	    ;
+    }
+
+    /* pthread_setspecific() may allocate, which must not be recorded */
+    my_ring = r;
+    in_shim = 1;
+    pthread_setspecific(ring_key, r);
+    in_shim = 0;
+    return r;
+}
+
+/*
+ * release_ring - Give up the ring of an exiting thread.  The flusher still
+ *     drains what is left in it.
+ */
+static void release_ring(void *arg)
+{
+    ring_t *r = arg;
+
+    my_ring = NULL;
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * flush_thread - Drain every ring into the capture file until stopped
+ */
+static void *flush_thread(void *arg)
+{
+    struct timespec period = {0, FLUSH_NSEC};
+
+    (void)arg;
+    in_shim = 1;
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+	flush_all();
+	nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * flush_ring - Write out the records of a ring that are not yet flushed
+ */
+static void flush_ring(ring_t *r)
+{
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->tail;
+    uint64_t n;
+    size_t len, done;
+    ssize_t rc;
+    char *buf;
+
+    while (tail != head) {
+	/* Write up to the end of the ring, then from its start */
+	n = RING_SIZE - (tail & (RING_SIZE - 1));
+	n = (head - tail < n) ? head - tail : n;
+	buf = (char *)&r->recs[tail & (RING_SIZE - 1)];
+	len = n * sizeof(caprec_t);
+	for (done = 0; done < len; done += rc) {
+	    if ((rc = write(cap_fd, buf + done, len - done)) < 0) {
+		if (errno == EINTR) {
+		    rc = 0;
+		    continue;
+		}
+		/* Drop the records rather than stall the program */
+		break;
+	    }
+	}
+	tail += n;
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * flush_all - Drain every ring
+ */
+static void flush_all(void)
+{
+    ring_t *r;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL;
+	 r = r->next)
+	flush_ring(r);
+}
+
+/*
+ * forked_child - Stop capturing in a child, which has no flusher
+ */
+static void forked_child(void)
+{
+    __atomic_store_n(&capturing, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,153 @@
+/*
+ * mmpreload.c - Run the student's malloc package as a process's allocator
+ *
+ * Usage:
+ *     LD_PRELOAD=./libmm.so <program> ...
+ *
+ * libmm.so holds the thread-safe build of mm.c, memlib.c with arenas
+ * large enough for a real heap, and the wrappers below, which export the
+ * malloc family of the C library on top of mm.c.  memlib reserves its
+ * arenas once and makes their pages accessible as the heaps grow, so the
+ * process's heap is as large as MAX_ARENAS arenas of MEM_ARENA_SIZE
+ * bytes, plus whatever regions huge blocks are given.
+ *
+ * The package is initialized by the first call into it, which may come
+ * from the C library itself before main().  A request for zero bytes is
+ * given a block of one byte, as programs expect a distinct pointer, and
+ * a failed request sets errno to ENOMEM.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int ready;  /* has the package been initialized? */
+
+static void preload_init(void);
+static void *check(void *ptr);
+static int valid_alignment(size_t alignment);
+
+/* Initialize the package unless that has been done */
+#define INIT() do {						\
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE))		\
+	pthread_once(&init_once, preload_init);			\
+} while (0)
+
+void *malloc(size_t size)
+{
+    INIT();
+    return check(mm_malloc(size != 0 ? size : 1));
+}
+
+void free(void *ptr)
+{
+    /* Nothing can be freed before the first allocation */
+    if (ptr != NULL)
+	mm_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    INIT();
+    if (nmemb == 0 || size == 0)
+	nmemb = size = 1;
+    return check(mm_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    INIT();
+    if (ptr == NULL)
+	return malloc(size);
+
+    /* Like the C library's, a realloc to zero bytes frees the block */
+    if (size == 0) {
+	mm_free(ptr);
+	return NULL;
+    }
+    return check(mm_realloc(ptr, size));
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    INIT();
+    if (!valid_alignment(alignment) || alignment % sizeof(void *) != 0)
+	return EINVAL;
+    if ((ptr = mm_memalign(alignment, size != 0 ? size : 1)) == NULL)
+	return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    INIT();
+    if (!valid_alignment(alignment)) {
+	errno = EINVAL;
+	return NULL;
+    }
+    return check(mm_memalign(alignment, size != 0 ? size : 1));
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return aligned_alloc(mem_pagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+
+    if (size > SIZE_MAX - pagesize) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return aligned_alloc(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    return mm_usable_size(ptr);
+}
+
+/*
+ * preload_init - Set up memlib's arenas and the package, once
+ */
+static void preload_init(void)
+{
+    mem_init();
+    if (mm_init() < 0)
+	abort();
+    __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * check - Return ptr, setting errno if the request for it failed
+ */
+static void *check(void *ptr)
+{
+    if (ptr == NULL)
+	errno = ENOMEM;
+    return ptr;
+}
+
+/*
+ * valid_alignment - Is alignment a power of two?
+ */
+static int valid_alignment(size_t alignment)
+{
+    return alignment != 0 && (alignment & (alignment - 1)) == 0;
+}
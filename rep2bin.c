@@ -0,0 +1,109 @@
+/*
+ * rep2bin.c - Convert a text .rep trace into a binary trace file
+ *
+ * The text trace is read one request at a time and the binary trace is
+ * written as it is read, so that traces too large for memory can be
+ * converted.  See trace.h for the binary format.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024 /* max string size */
+
+static void usage(void);
+static void unix_error(char *msg, char *path);
+static void app_error(char *msg, char *path);
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    tracehdr_t hdr;
+    traceop_t op;
+    char type[MAXLINE];
+    unsigned index, size, n;
+    unsigned max_index = 0;
+    unsigned op_index = 0;
+
+    if (argc != 3) {
+	usage();
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+	unix_error("Could not open", argv[1]);
+    if ((out = fopen(argv[2], "w")) == NULL)
+	unix_error("Could not create", argv[2]);
+
+    /* Copy the header, which the text trace holds as four numbers */
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    hdr.order = TRACE_ORDER;
+    if (fscanf(in, "%u %u %u %u", &hdr.sugg_heapsize, &hdr.num_ids,
+	       &hdr.num_ops, &hdr.weight) != 4)
+	app_error("Bad header in", argv[1]);
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+	unix_error("Could not write", argv[2]);
+
+    /* Translate every request line in the trace file */
+    while (fscanf(in, "%s", type) != EOF) {
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	    n = fscanf(in, "%u %u", &index, &size);
+	    op.type = (type[0] == 'a') ? ALLOC : REALLOC;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'f':
+	    n = fscanf(in, "%u", &index) + 1;
+	    op.type = FREE;
+	    size = 0;
+	    break;
+	default:
+	    n = 0;
+	}
+	if (n != 2 || index >= hdr.num_ids)
+	    app_error("Bad request in", argv[1]);
+	op.index = index;
+	op.size = size;
+	if (fwrite(&op, sizeof(op), 1, out) != 1)
+	    unix_error("Could not write", argv[2]);
+	op_index++;
+    }
+
+    if (op_index != hdr.num_ops || max_index != hdr.num_ids - 1)
+	app_error("Header does not match the requests in", argv[1]);
+    if (fclose(out) != 0)
+	unix_error("Could not write", argv[2]);
+    fclose(in);
+    exit(0);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: rep2bin <trace.rep> <trace.bin>\n");
+}
+
+/* 
+ * unix_error - Report a Unix-style error about the file at path
+ */
+static void unix_error(char *msg, char *path)
+{
+    fprintf(stderr, "%s %s: %s\n", msg, path, strerror(errno));
+    exit(1);
+}
+
+/* 
+ * app_error - Report an error in the contents of the file at path
+ */
+static void app_error(char *msg, char *path)
+{
+    fprintf(stderr, "%s %s\n", msg, path);
+    exit(1);
+}
@@ -0,0 +1,61 @@
+/*
+ * trace.h - The requests of a trace, and the binary trace file format
+ *
+ * A binary trace file is a tracehdr_t followed by num_ops traceop_t
+ * records, all in the byte order of the machine that wrote it.  The
+ * records are laid out exactly as in memory, so that a reader can map
+ * the file and use the records in place, without parsing them.  Binary
+ * traces are made from text .rep traces by rep2bin.  Both kinds of trace
+ * can be made from a capture of a running program by cap2rep.
+ */
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "mmtrace"  /* first 8 bytes of a binary trace file */
+#define TRACE_ORDER 0x01020304 /* reads as this in the writer's byte order */
+
+/* Types of request */
+enum {ALLOC, FREE, REALLOC};
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    uint32_t type;   /* type of request */
+    int32_t index;   /* index for free() to use later */
+    int32_t size;    /* byte size of alloc/realloc request, 0 for free */
+} traceop_t;
+
+/* The header of a binary trace file, the same as that of a text trace */
+typedef struct {
+    char magic[8];           /* TRACE_MAGIC, with its terminating NUL */
+    uint32_t order;          /* TRACE_ORDER */
+    uint32_t sugg_heapsize;  /* suggested heap size (unused) */
+    uint32_t num_ids;        /* number of alloc/realloc ids */
+    uint32_t num_ops;        /* number of distinct requests */
+    uint32_t weight;         /* weight for this trace (unused) */
+} tracehdr_t;
+
+/*
+ * Records captured by the mmcapture preload library.  A capture file
+ * holds them in no particular order; cap2rep sorts them by seq, whose
+ * low two bits hold the kind of record, and turns them into a trace.  A
+ * realloc is captured as the release of its old block, numbered before
+ * the call, and its new block, numbered after it, so that every block is
+ * given up before another thread can be handed its address.
+ */
+#define CAP_ALLOC   0  /* ptr was allocated with size bytes */
+#define CAP_FREE    1  /* ptr was freed */
+#define CAP_RELEASE 2  /* ptr was given to realloc */
+#define CAP_REALLOC 3  /* realloc returned ptr with size bytes for the
+			  block released by record link */
+#define CAP_KIND(seq)  ((int)((seq) & 3))
+
+typedef struct {
+    uint64_t seq;   /* order of the request, times 4, plus its kind */
+    uint64_t ptr;   /* address of the block */
+    uint64_t size;  /* requested size, for CAP_ALLOC and CAP_REALLOC */
+    uint64_t link;  /* seq of the CAP_RELEASE of a CAP_REALLOC */
+} caprec_t;
+
+#endif /* __TRACE_H_ */
@@ -0,0 +1,527 @@
+/*
+ * tracegen.c - Generate a synthetic trace from parameterized distributions
+ *
+ * A trace is generated as one or more streams of requests, interleaved at
+ * random, each with its own blocks.  Every block is given a lifetime when
+ * it is allocated, counted in the allocations its stream makes after it,
+ * and is freed once its stream has made that many.  By Little's law a
+ * stream then holds about as many live blocks as the mean lifetime, so
+ * the lifetimes are drawn with a mean of the live set's size divided
+ * among the streams.  Until the first blocks die, the heap only grows.
+ * A request that does not free a dead block allocates a new one or, with
+ * a given probability, reallocates a live block of its stream, resized by
+ * a constant factor.  Once about num_ops requests have been made, every
+ * live block is freed, so the trace is balanced.
+ *
+ * Ids are handed out densely, and the id of a freed block is reused by the
+ * next allocation, so that num_ids is the most blocks live at once.  By
+ * default the trace is written as a text .rep trace; with -b, as a binary
+ * trace (trace.h).  The same seed always generates the same trace.
+ *
+ * The streams model the interleaving that a shared heap sees from the
+ * requests of several threads.  To replay a trace on several threads at
+ * once instead, use mdriver-mt -j.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Distributions of sizes and lifetimes */
+enum {UNIFORM, POWER, BIMODAL, EXP, FIXED, PARETO};
+
+/* The parameters of a trace */
+typedef struct {
+    size_t num_ops;    /* most requests, including the frees at the end */
+    size_t live;       /* mean blocks live at once, over all streams */
+    int size_dist;     /* UNIFORM, POWER or BIMODAL */
+    uint32_t min, max; /* smallest and largest size allocated */
+    double alpha;      /* exponent of the POWER sizes and PARETO lifetimes */
+    double large;      /* share of the BIMODAL sizes in the large mode */
+    int life_dist;     /* EXP, FIXED or PARETO */
+    double realloc;    /* share of the other requests that are reallocs */
+    double growth;     /* factor by which a realloc changes a block */
+    int streams;       /* number of interleaved streams */
+} params_t;
+
+/* A live block, in the heap of its stream ordered by time of death */
+typedef struct {
+    uint64_t death;    /* the stream's allocations when the block dies */
+    uint32_t id;
+} death_t;
+
+/* One stream of requests */
+typedef struct {
+    uint64_t clock;    /* allocations made so far */
+    death_t *heap;     /* live blocks, a min-heap by time of death */
+    size_t num_live;
+    size_t max_live;   /* number of blocks that fit in heap */
+} stream_t;
+
+/* The trace being built */
+typedef struct {
+    traceop_t *ops;
+    size_t num_ops;
+    uint32_t num_ids;
+    uint32_t *free_ids;   /* stack of ids free for reuse */
+    size_t num_free;
+    uint32_t *sizes;      /* size of each live block, by id */
+    size_t max_ids;       /* number of ids that fit in free_ids and sizes */
+    size_t live_bytes;    /* bytes live now and at most */
+    size_t peak_bytes;
+} trace_t;
+
+static uint64_t rng_state;  /* state of the xorshift64* generator */
+
+static void generate(params_t *p, trace_t *trace);
+static uint32_t new_block(params_t *p, trace_t *trace);
+static void free_block(trace_t *trace, stream_t *s);
+static void realloc_block(params_t *p, trace_t *trace, stream_t *s);
+static void heap_push(stream_t *s, uint64_t death, uint32_t id);
+static void heap_pop(stream_t *s);
+static uint32_t draw_size(params_t *p);
+static uint64_t draw_life(params_t *p, double mean);
+static double uniform(uint32_t lo, uint32_t hi);
+static double rng_double(void);
+static int parse_dist(char *name, int *dist);
+static void *xrealloc(void *ptr, size_t size);
+static void usage(void);
+static void unix_error(char *msg, char *path);
+static void app_error(char *msg, char *path);
+
+int main(int argc, char **argv)
+{
+    params_t p;
+    trace_t trace;
+    tracehdr_t hdr;
+    FILE *out;
+    int c, binary = 0;
+    char *outpath;
+    size_t i;
+
+    p.num_ops = 100000;
+    p.live = 1000;
+    p.size_dist = POWER;
+    p.min = 8;
+    p.max = 4096;
+    p.alpha = 1.2;
+    p.large = 0.1;
+    p.life_dist = EXP;
+    p.realloc = 0;
+    p.growth = 2;
+    p.streams = 1;
+    rng_state = 1;
+
+    while ((c = getopt(argc, argv, "a:bg:l:L:m:M:n:p:r:s:S:t:h")) != EOF) {
+	switch (c) {
+	case 'a': /* Exponent of power-law sizes and Pareto lifetimes */
+	    p.alpha = atof(optarg);
+	    break;
+	case 'b': /* Write a binary trace */
+	    binary = 1;
+	    break;
+	case 'g': /* Factor by which a realloc changes a block's size */
+	    p.growth = atof(optarg);
+	    break;
+	case 'l': /* Mean number of live blocks */
+	    p.live = strtoul(optarg, NULL, 0);
+	    break;
+	case 'L': /* Distribution of lifetimes */
+	    if (!parse_dist(optarg, &p.life_dist) || p.life_dist < EXP) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'm': /* Smallest size */
+	    p.min = strtoul(optarg, NULL, 0);
+	    break;
+	case 'M': /* Largest size */
+	    p.max = strtoul(optarg, NULL, 0);
+	    break;
+	case 'n': /* Number of requests */
+	    p.num_ops = strtoul(optarg, NULL, 0);
+	    break;
+	case 'p': /* Share of bimodal sizes in the large mode */
+	    p.large = atof(optarg);
+	    break;
+	case 'r': /* Share of requests that are reallocs */
+	    p.realloc = atof(optarg);
+	    break;
+	case 's': /* Distribution of sizes */
+	    if (!parse_dist(optarg, &p.size_dist) || p.size_dist > BIMODAL) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'S': /* Seed */
+	    rng_state = strtoull(optarg, NULL, 0);
+	    break;
+	case 't': /* Number of interleaved streams */
+	    p.streams = atoi(optarg);
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (optind != argc - 1) {
+	usage();
+	exit(1);
+    }
+    outpath = argv[optind];
+
+    /* xorshift64* would stay at 0, so a seed of 0 is taken as 1 */
+    rng_state = (rng_state != 0) ? rng_state : 1;
+    if (p.min < 1 || p.max < p.min || p.max > INT32_MAX)
+	app_error("Sizes must be from 1 to", "2^31-1");
+    if (p.num_ops < 2 || p.num_ops > INT32_MAX || p.live < 1 ||
+	p.streams < 1 || p.streams > (int)p.live)
+	app_error("Bad request or block counts for", outpath);
+    if (p.alpha <= (p.life_dist == PARETO ? 1 : 0) || p.large < 0 ||
+	p.large > 1 || p.realloc < 0 || p.realloc > 1 || p.growth <= 0)
+	app_error("Bad distribution parameters for", outpath);
+
+    generate(&p, &trace);
+
+    if ((out = fopen(outpath, "w")) == NULL)
+	unix_error("Could not create", outpath);
+    if (binary) {
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	hdr.order = TRACE_ORDER;
+	hdr.num_ids = trace.num_ids;
+	hdr.num_ops = trace.num_ops;
+	hdr.weight = 1;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+	    fwrite(trace.ops, sizeof(traceop_t), trace.num_ops, out) !=
+	    trace.num_ops)
+	    unix_error("Could not write", outpath);
+    } else {
+	fprintf(out, "0\n%u\n%zu\n1\n", trace.num_ids, trace.num_ops);
+	for (i = 0; i < trace.num_ops; i++) {
+	    switch (trace.ops[i].type) {
+	    case ALLOC:
+		fprintf(out, "a %d %d\n", trace.ops[i].index,
+			trace.ops[i].size);
+		break;
+	    case REALLOC:
+		fprintf(out, "r %d %d\n", trace.ops[i].index,
+			trace.ops[i].size);
+		break;
+	    case FREE:
+		fprintf(out, "f %d\n", trace.ops[i].index);
+		break;
+	    }
+	}
+    }
+    if (fclose(out) != 0)
+	unix_error("Could not write", outpath);
+    fprintf(stderr, "%s: %zu requests, %u ids, %zu KB live at most\n",
+	    outpath, trace.num_ops, trace.num_ids, trace.peak_bytes / 1024);
+    exit(0);
+}
+
+/*
+ * generate - Make the requests of a trace with the parameters p
+ */
+static void generate(params_t *p, trace_t *trace)
+{
+    stream_t *streams, *s;
+    double mean = (double)p->live / p->streams;
+    size_t live = 0;
+    uint32_t id;
+    int i;
+
+    /* The loop below stops with room for the frees of the live blocks */
+    trace->ops = xrealloc(NULL, p->num_ops * sizeof(traceop_t));
+    trace->num_ops = 0;
+    trace->num_ids = 0;
+    trace->free_ids = NULL;
+    trace->num_free = 0;
+    trace->sizes = NULL;
+    trace->max_ids = 0;
+    trace->live_bytes = trace->peak_bytes = 0;
+    streams = xrealloc(NULL, p->streams * sizeof(stream_t));
+    memset(streams, 0, p->streams * sizeof(stream_t));
+
+    /* Leave room for the frees of the live blocks, and an allocation's */
+    while (trace->num_ops + live + 2 <= p->num_ops) {
+	s = &streams[(int)(rng_double() * p->streams)];
+	if (s->num_live > 0 && s->heap[0].death <= s->clock) {
+	    free_block(trace, s);
+	    live--;
+	} else if (s->num_live > 0 && rng_double() < p->realloc) {
+	    realloc_block(p, trace, s);
+	} else {
+	    id = new_block(p, trace);
+	    heap_push(s, s->clock + draw_life(p, mean), id);
+	    s->clock++;
+	    live++;
+	}
+    }
+
+    /* Free what is left, in order of death */
+    for (i = 0; i < p->streams; i++) {
+	while (streams[i].num_live > 0)
+	    free_block(trace, &streams[i]);
+	free(streams[i].heap);
+    }
+    free(streams);
+}
+
+/*
+ * new_block - Allocate a block of a drawn size, and return its id
+ */
+static uint32_t new_block(params_t *p, trace_t *trace)
+{
+    traceop_t *op = &trace->ops[trace->num_ops++];
+    uint32_t id;
+
+    if (trace->num_free > 0) {
+	id = trace->free_ids[--trace->num_free];
+    } else {
+	if (trace->num_ids == trace->max_ids) {
+	    trace->max_ids = (trace->max_ids > 0) ? 2 * trace->max_ids : 1024;
+	    trace->free_ids = xrealloc(trace->free_ids,
+				       trace->max_ids * sizeof(uint32_t));
+	    trace->sizes = xrealloc(trace->sizes,
+				    trace->max_ids * sizeof(uint32_t));
+	}
+	id = trace->num_ids++;
+    }
+    op->type = ALLOC;
+    op->index = id;
+    op->size = trace->sizes[id] = draw_size(p);
+    trace->live_bytes += op->size;
+    if (trace->live_bytes > trace->peak_bytes)
+	trace->peak_bytes = trace->live_bytes;
+    return id;
+}
+
+/*
+ * free_block - Free the block of stream s that dies first
+ */
+static void free_block(trace_t *trace, stream_t *s)
+{
+    traceop_t *op = &trace->ops[trace->num_ops++];
+    uint32_t id = s->heap[0].id;
+
+    heap_pop(s);
+    op->type = FREE;
+    op->index = id;
+    op->size = 0;
+    trace->live_bytes -= trace->sizes[id];
+    trace->free_ids[trace->num_free++] = id;
+}
+
+/*
+ * realloc_block - Change the size of a random live block of stream s by
+ *     the growth factor, keeping it from min to max bytes
+ */
+static void realloc_block(params_t *p, trace_t *trace, stream_t *s)
+{
+    traceop_t *op = &trace->ops[trace->num_ops++];
+    uint32_t id = s->heap[(size_t)(rng_double() * s->num_live)].id;
+    double size = ceil(trace->sizes[id] * p->growth);
+
+    size = (size < p->min) ? p->min : (size > p->max) ? p->max : size;
+    op->type = REALLOC;
+    op->index = id;
+    op->size = (uint32_t)size;
+    trace->live_bytes = trace->live_bytes - trace->sizes[id] + op->size;
+    trace->sizes[id] = op->size;
+    if (trace->live_bytes > trace->peak_bytes)
+	trace->peak_bytes = trace->live_bytes;
+}
+
+/*
+ * heap_push - Add block id, which dies at death, to the heap of stream s
+ */
+static void heap_push(stream_t *s, uint64_t death, uint32_t id)
+{
+    size_t i, parent;
+
+    if (s->num_live == s->max_live) {
+	s->max_live = (s->max_live > 0) ? 2 * s->max_live : 64;
+	s->heap = xrealloc(s->heap, s->max_live * sizeof(death_t));
+    }
+    for (i = s->num_live++; i > 0; i = parent) {
+	parent = (i - 1) / 2;
+	if (s->heap[parent].death <= death)
+	    break;
+	s->heap[i] = s->heap[parent];
+    }
+    s->heap[i].death = death;
+    s->heap[i].id = id;
+}
+
+/*
+ * heap_pop - Remove the block that dies first from the heap of stream s
+ */
+static void heap_pop(stream_t *s)
+{
+    death_t last = s->heap[--s->num_live];
+    size_t i = 0, child;
+
+    while ((child = 2 * i + 1) < s->num_live) {
+	if (child + 1 < s->num_live &&
+	    s->heap[child + 1].death < s->heap[child].death)
+	    child++;
+	if (last.death <= s->heap[child].death)
+	    break;
+	s->heap[i] = s->heap[child];
+	i = child;
+    }
+    s->heap[i] = last;
+}
+
+/*
+ * draw_size - Draw the size of a new block.  POWER sizes follow a Pareto
+ *     distribution with exponent alpha, bounded by min and max.  BIMODAL
+ *     sizes are uniform over [min, 4 min] or, with probability large,
+ *     over [max / 4, max].
+ */
+static uint32_t draw_size(params_t *p)
+{
+    double lo = p->min, hi = p->max, u, size;
+
+    switch (p->size_dist) {
+    case POWER:
+	u = rng_double();
+	size = lo / pow(1 - u * (1 - pow(lo / hi, p->alpha)), 1 / p->alpha);
+	break;
+    case BIMODAL:
+	if (rng_double() < p->large)
+	    size = uniform((p->max / 4 > p->min) ? p->max / 4 : p->min,
+			   p->max);
+	else
+	    size = uniform(p->min, (p->min <= p->max / 4) ? 4 * p->min :
+			   p->max);
+	break;
+    default:
+	size = uniform(p->min, p->max);
+    }
+    size = floor(size);
+    return (uint32_t)((size < lo) ? lo : (size > hi) ? hi : size);
+}
+
+/*
+ * draw_life - Draw the lifetime of a new block, in allocations, with the
+ *     given mean.  PARETO lifetimes have exponent alpha, which must exceed
+ *     1 for the mean to exist.
+ */
+static uint64_t draw_life(params_t *p, double mean)
+{
+    double u = 1 - rng_double();  /* in (0, 1] */
+
+    switch (p->life_dist) {
+    case FIXED:
+	return (uint64_t)mean;
+    case PARETO:
+	return (uint64_t)(mean * (p->alpha - 1) / p->alpha /
+			  pow(u, 1 / p->alpha));
+    default:
+	return (uint64_t)(-mean * log(u));
+    }
+}
+
+/*
+ * uniform - Draw a number uniformly from [lo, hi + 1)
+ */
+static double uniform(uint32_t lo, uint32_t hi)
+{
+    return lo + rng_double() * ((double)hi - lo + 1);
+}
+
+/*
+ * rng_double - Draw a number uniformly from [0, 1), by xorshift64*
+ */
+static double rng_double(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+}
+
+/*
+ * parse_dist - Set dist to the distribution called name; return 0 if
+ *     there is none
+ */
+static int parse_dist(char *name, int *dist)
+{
+    static char *names[] = {"uniform", "power", "bimodal", "exp", "fixed",
+			    "pareto"};
+    int i;
+
+    for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+	if (strcmp(name, names[i]) == 0) {
+	    *dist = i;
+	    return 1;
+	}
+    return 0;
+}
+
+/*
+ * xrealloc - Resize the allocation at ptr to size bytes, or exit
+ */
+static void *xrealloc(void *ptr, size_t size)
+{
+    if ((ptr = realloc(ptr, size)) == NULL)
+	unix_error("Could not allocate", "memory");
+    return ptr;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracegen [-bh] [-n <ops>] [-l <live>] [-s <dist>] [-m <min>]\n");
+    fprintf(stderr, "                [-M <max>] [-a <alpha>] [-p <share>] [-L <dist>]\n");
+    fprintf(stderr, "                [-r <share>] [-g <factor>] [-t <streams>] [-S <seed>]\n");
+    fprintf(stderr, "                <trace>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a <alpha>    Exponent of power sizes and pareto lifetimes (1.2).\n");
+    fprintf(stderr, "\t-b            Write a binary trace instead of a .rep trace.\n");
+    fprintf(stderr, "\t-g <factor>   Factor by which a realloc resizes a block (2).\n");
+    fprintf(stderr, "\t-h            Print this message.\n");
+    fprintf(stderr, "\t-l <live>     Mean number of blocks live at once (1000).\n");
+    fprintf(stderr, "\t-L <dist>     Lifetimes: exp, fixed or pareto (exp).\n");
+    fprintf(stderr, "\t-m <min>      Smallest block size (8).\n");
+    fprintf(stderr, "\t-M <max>      Largest block size (4096).\n");
+    fprintf(stderr, "\t-n <ops>      Number of requests, including the final frees\n");
+    fprintf(stderr, "\t              (100000).\n");
+    fprintf(stderr, "\t-p <share>    Share of bimodal sizes near <max> (0.1).\n");
+    fprintf(stderr, "\t-r <share>    Share of the requests other than frees that\n");
+    fprintf(stderr, "\t              are reallocs (0).\n");
+    fprintf(stderr, "\t-s <dist>     Sizes: uniform, power or bimodal (power).\n");
+    fprintf(stderr, "\t-S <seed>     Seed of the random generator (1).\n");
+    fprintf(stderr, "\t-t <streams>  Number of interleaved request streams (1).\n");
+}
+
+/*
+ * unix_error - Report a Unix-style error about the file at path
+ */
+static void unix_error(char *msg, char *path)
+{
+    fprintf(stderr, "%s %s: %s\n", msg, path, strerror(errno));
+    exit(1);
+}
+
+/*
+ * app_error - Report an error in the parameters of the trace at path
+ */
+static void app_error(char *msg, char *path)
+{
+    fprintf(stderr, "%s %s\n", msg, path);
+    exit(1);
+}